@@ -2,50 +2,100 @@
 
 #include "BitmapAllocator.hpp"
 
-namespace xxfs {
-
-BitmapAllocator::X_BmpPtr BitmapAllocator::X_Map(int fd, uint32_t lcn, uint32_t cc) {
-    auto cbSize = (size_t) kcbCluSize * cc;
-    auto cbOff = (off_t) kcbCluSize * lcn;
-    auto pVoid = mmap(nullptr, cbSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, cbOff);
-    if (pVoid == MAP_FAILED)
-        RAISE("Failed to map bitmap", errno);
-    return {reinterpret_cast<uint64_t *>(pVoid), X_Deleter {cbSize}};
-}
-
+namespace xxfs { inline namespace XXFS_CLU_NS {
 
-BitmapAllocator::BitmapAllocator(int fd, uint32_t lcnBmp, uint32_t ccBmp) :
-    x_cqBmp {ccBmp * kcqPerClu}, x_upBmp {X_Map(fd, lcnBmp, ccBmp)}
-{}
+BitmapAllocator::BitmapAllocator(int fd, Lcn lcnBmp, Lcn ccBmp, uint32_t cGrp, bool bHuge) :
+    x_cqBmp {ccBmp * kcqPerClu},
+    x_cqPerGrp {(x_cqBmp + cGrp - 1) / cGrp},
+    x_upBmp {RunMap<uint64_t>(fd, lcnBmp, ccBmp, bHuge)},
+    x_vecFree((x_cqBmp + x_cqPerGrp - 1) / x_cqPerGrp)
+{
+    // the tail past the total is set by mkxxfs and never counts as free
+    for (Lcn i = 0; i < x_cqBmp; ++i)
+        x_vecFree[i / x_cqPerGrp] += (Lcn) __builtin_popcountll(~x_upBmp[i]);
+}
 
-uint32_t BitmapAllocator::Alloc() {
-    for (uint32_t i = x_vqwCur; i < x_cqBmp; ++i) {
-        auto &uCur = x_upBmp[i];
-        for (uint32_t j = 0; j < 64; ++j) {
-            auto uMask = uint64_t {1} << j;
-            if (uMask & ~uCur) {
-                uCur |= uMask;
-                return i * 64 + j;
-            }
+Lcn BitmapAllocator::Alloc(Lcn lbiHint) {
+    auto vqwHint = lbiHint / 64;
+    if (vqwHint < x_cqBmp) {
+        auto uMask = uint64_t {1} << (lbiHint % 64);
+        if (uMask & ~x_upBmp[vqwHint]) {
+            x_upBmp[vqwHint] |= uMask;
+            --x_vecFree[vqwHint / x_cqPerGrp];
+            return lbiHint;
         }
     }
-    for (uint32_t i = 0; i < x_vqwCur; ++i) {
-        auto &uCur = x_upBmp[i];
-        for (uint32_t j = 0; j < 64; ++j) {
-            auto uMask = uint64_t {1} << j;
-            if (uMask & ~uCur) {
-                uCur |= uMask;
-                return i * 64 + j;
-            }
-        }
+    else
+        vqwHint = 0;
+    auto cGrp = CountGroups();
+    auto vGrpHint = (uint32_t) (vqwHint / x_cqPerGrp);
+    Lcn lbi;
+    // the group of the hint is visited twice: from the hint to its end, at last from its start to the hint
+    for (uint32_t i = 0; i <= cGrp; ++i) {
+        auto vGrp = (vGrpHint + i) % cGrp;
+        if (!x_vecFree[vGrp])
+            continue;
+        auto vqwBegin = i ? vGrp * x_cqPerGrp : vqwHint;
+        auto vqwEnd = i == cGrp ? vqwHint : std::min(x_cqBmp, (vGrp + 1) * x_cqPerGrp);
+        for (auto vqw = vqwBegin; vqw < vqwEnd; ++vqw)
+            if (X_Take(vqw, lbi))
+                return lbi;
     }
     throw Exception {ENOSPC};
 }
 
-void BitmapAllocator::Free(uint32_t lbi) noexcept {
+Lcn BitmapAllocator::FindRun(Lcn lbiHint, uint32_t cbi) const noexcept {
+    constexpr Lcn kcqScan = 8 * kcqPerClu;
+    auto lbiEnd = (uint64_t) 64 * std::min(x_cqBmp, lbiHint / 64 + kcqScan);
+    Lcn lbiRun = lbiHint;
+    uint32_t cbiRun = 0;
+    Lcn lbiBest = lbiHint;
+    uint32_t cbiBest = 0;
+    for (uint64_t lbi = lbiHint; lbi < lbiEnd; ) {
+        auto uCur = x_upBmp[lbi / 64];
+        if (!(lbi % 64) && !~uCur) {
+            cbiRun = 0;
+            lbi += 64;
+            continue;
+        }
+        uint32_t cbiStep = 1;
+        if (!(lbi % 64) && !uCur) {
+            if (!cbiRun)
+                lbiRun = (Lcn) lbi;
+            cbiStep = 64;
+            cbiRun += 64;
+        }
+        else if (uCur & (uint64_t {1} << (lbi % 64)))
+            cbiRun = 0;
+        else if (!cbiRun++)
+            lbiRun = (Lcn) lbi;
+        if (cbiRun >= cbi)
+            return lbiRun;
+        if (cbiRun > cbiBest) {
+            lbiBest = lbiRun;
+            cbiBest = cbiRun;
+        }
+        lbi += cbiStep;
+    }
+    return lbiBest;
+}
+
+void BitmapAllocator::Free(Lcn lbi) noexcept {
     auto vbi = lbi % 64;
     auto vqw = lbi / 64;
     x_upBmp[vqw] &= ~(uint64_t {1} << vbi);
+    ++x_vecFree[vqw / x_cqPerGrp];
 }
 
+inline bool BitmapAllocator::X_Take(Lcn vqw, Lcn &lbi) noexcept {
+    auto &uCur = x_upBmp[vqw];
+    if (!~uCur)
+        return false;
+    auto vbi = (uint32_t) __builtin_ctzll(~uCur);
+    uCur |= uint64_t {1} << vbi;
+    --x_vecFree[vqw / x_cqPerGrp];
+    lbi = vqw * 64 + vbi;
+    return true;
 }
+
+}}
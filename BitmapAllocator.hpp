@@ -5,34 +5,49 @@
 
 #include "Raii.hpp"
 
-namespace xxfs {
+namespace xxfs { inline namespace XXFS_CLU_NS {
 
 class BitmapAllocator : NoCopyMove {
-private:
-    struct X_Deleter {
-        inline void operator ()(void *pObj) noexcept {
-            munmap(pObj, cbSize);
-        }
+public:
+    // the bitmap is split into cGrp allocation groups of equal size, each with its own free counter
+    BitmapAllocator(int fd, Lcn lcnBmp, Lcn ccBmp, uint32_t cGrp, bool bHuge = false);
 
-        size_t cbSize;
-    };
-    
-    using X_BmpPtr = std::unique_ptr<uint64_t[], X_Deleter>;
-    static X_BmpPtr X_Map(int fd, uint32_t lcn, uint32_t cc);
+    inline uint32_t CountGroups() const noexcept {
+        return (uint32_t) x_vecFree.size();
+    }
 
-public:
-    BitmapAllocator(int fd, uint32_t lcnBmp, uint32_t ccBmp);
+    inline uint32_t GroupOf(Lcn lbi) const noexcept {
+        return (uint32_t) (lbi / 64 / x_cqPerGrp);
+    }
+
+    inline Lcn GroupStart(uint32_t vGrp) const noexcept {
+        return vGrp * x_cqPerGrp * 64;
+    }
 
-    uint32_t Alloc();
-    void Free(uint32_t lbi) noexcept;
+    inline Lcn FreeIn(uint32_t vGrp) const noexcept {
+        return x_vecFree[vGrp];
+    }
+
+    // try lbiHint first, then the first free bit at or after it in its group
+    // then the following groups that have free bits (wrapping around)
+    Lcn Alloc(Lcn lbiHint = 0);
+    // the start of the first run of cbi free bits at or after lbiHint
+    // falls back to the longest run found within a bounded scan
+    Lcn FindRun(Lcn lbiHint, uint32_t cbi) const noexcept;
+    void Free(Lcn lbi) noexcept;
+
+private:
+    // take the lowest free bit in the qword if any and count it off its group
+    bool X_Take(Lcn vqw, Lcn &lbi) noexcept;
 
 private:
-    uint32_t x_vqwCur = 0;
-    uint32_t x_cqBmp;
-    X_BmpPtr x_upBmp;
+    Lcn x_cqBmp;
+    Lcn x_cqPerGrp;
+    RunPtr<uint64_t> x_upBmp;
+    std::vector<Lcn> x_vecFree;
 
 };
 
-}
+}}
 
 #endif
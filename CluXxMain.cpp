@@ -5,7 +5,14 @@
 #include <string>
 #include <vector>
 
-namespace xxfs { namespace {
+namespace xxfs {
+
+// the entries of the builds for every cluster size and lcn width
+#define X_ENTRY(s_, b_) namespace XXFS_BUILD_NS(s_, b_) { int CluXxMain(int ncArg, char *ppszArgs[]); }
+XXFS_BUILDS(X_ENTRY)
+#undef X_ENTRY
+
+inline namespace XXFS_CLU_NS { namespace {
 
 void ShowHelp(const char *pszExec) {
     printf(
@@ -44,27 +51,28 @@ constexpr const char *f_aTypeName[] {
 
 struct Request {
     ReqType vType = ReqType::kMeta;
-    uint32_t lcn = 0;
+    Lcn lcn = 0;
     uint32_t num = 0;
     std::string sFile {};
 
-    inline Request(ReqType vType_, uint32_t lcn_ = 0, uint32_t num_ = 0) :
+    inline Request(ReqType vType_, Lcn lcn_ = 0, uint32_t num_ = 0) :
         vType {vType_}, lcn {lcn_}, num {num_}
     {}
 
-    inline Request(ReqType vType_, uint32_t lcn_, const char *pszFile) :
+    inline Request(ReqType vType_, Lcn lcn_, const char *pszFile) :
         vType {vType_}, lcn {lcn_}, sFile(pszFile)
     {}
 };
 
 struct CvtExn {};
 
-inline uint32_t FromNtmbs(const char *psz) {
-    uint32_t uRes = 0;
+template<class tNum>
+inline tNum FromNtmbs(const char *psz) {
+    tNum uRes = 0;
     while (*psz) {
         if (!isdigit(*psz))
             throw CvtExn {};
-        auto uNew = uRes * 10 + (uint32_t) (*psz & 0x0f);
+        auto uNew = uRes * 10 + (tNum) (*psz & 0x0f);
         if (uNew < uRes)
             throw CvtExn {};
         uRes = uNew;
@@ -74,7 +82,7 @@ inline uint32_t FromNtmbs(const char *psz) {
 }
 
 template<class tObj>
-inline ShrPtr<tObj> RdMap(int fd, uint32_t lcn) {
+inline ShrPtr<tObj> RdMap(int fd, Lcn lcn) {
     auto pVoid = mmap(
         nullptr, kcbCluSize, PROT_READ,
         MAP_PRIVATE, fd, (off_t) kcbCluSize * lcn
@@ -84,10 +92,21 @@ inline ShrPtr<tObj> RdMap(int fd, uint32_t lcn) {
     return ShrPtr<tObj>(reinterpret_cast<tObj *>(pVoid), UnmapDeleter {});
 }
 
-}}
+// run the build for another cluster size or lcn width, it parses the arguments again
+int RunFor(uint32_t uShift, uint32_t uLcnBits, int ncArg, char *ppszArgs[]) {
+    optind = 1;
+#define X_RUN(s_, b_) \
+    if (uShift == s_ && uLcnBits == b_) \
+        return XXFS_BUILD_NS(s_, b_)::CluXxMain(ncArg, ppszArgs);
+    XXFS_BUILDS(X_RUN)
+#undef X_RUN
+    fprintf(stderr, "The cluster size or the lcn width is not supported.\n");
+    return -1;
+}
 
-int main(int ncArg, char *ppszArgs[]) {
-    using namespace xxfs;
+}}}
+
+int xxfs::XXFS_CLU_NS::CluXxMain(int ncArg, char *ppszArgs[]) {
     std::vector<Request> vecReqs;
     const char *pszPath = nullptr;
     bool bHelp = false;
@@ -108,8 +127,8 @@ int main(int ncArg, char *ppszArgs[]) {
                 bIncorrect = true;
                 break;
             }
-            auto lcn = FromNtmbs(ppszArgs[optind++]);
-            auto num = FromNtmbs(ppszArgs[optind++]);
+            auto lcn = FromNtmbs<Lcn>(ppszArgs[optind++]);
+            auto num = FromNtmbs<uint32_t>(ppszArgs[optind++]);
             vecReqs.emplace_back(ReqType::kIndex, lcn, num);
             break;
         }
@@ -118,7 +137,7 @@ int main(int ncArg, char *ppszArgs[]) {
                 bIncorrect = true;
                 break;
             }
-            auto lin = FromNtmbs(ppszArgs[optind++]);
+            auto lin = FromNtmbs<uint32_t>(ppszArgs[optind++]);
             vecReqs.emplace_back(ReqType::kInode, 0, lin);
             break;
         }
@@ -127,8 +146,8 @@ int main(int ncArg, char *ppszArgs[]) {
                 bIncorrect = true;
                 break;
             }
-            auto lcn = FromNtmbs(ppszArgs[optind++]);
-            auto ven = FromNtmbs(ppszArgs[optind++]);
+            auto lcn = FromNtmbs<Lcn>(ppszArgs[optind++]);
+            auto ven = FromNtmbs<uint32_t>(ppszArgs[optind++]);
             vecReqs.emplace_back(ReqType::kDir, lcn, ven);
             break;
         }
@@ -137,7 +156,7 @@ int main(int ncArg, char *ppszArgs[]) {
                 bIncorrect = true;
                 break;
             }
-            auto lcn = FromNtmbs(ppszArgs[optind++]);
+            auto lcn = FromNtmbs<Lcn>(ppszArgs[optind++]);
             auto pszFile = ppszArgs[optind++];
             vecReqs.emplace_back(ReqType::kDump, lcn, pszFile);
             break;
@@ -164,6 +183,9 @@ int main(int ncArg, char *ppszArgs[]) {
         ShowHelp(ppszArgs[0]);
         return -1;
     }
+    auto [uShift, uLcnBits] = ProbeBuild(pszPath);
+    if (uShift && (uShift != kCluShift || uLcnBits != kLcnBits))
+        return RunFor(uShift, uLcnBits, ncArg, ppszArgs);
     auto fd = open(pszPath, O_RDONLY | O_DIRECT);
     if (fd == -1) {
         fprintf(stderr, "Failed to open file: %s.\n", pszPath);
@@ -172,30 +194,35 @@ int main(int ncArg, char *ppszArgs[]) {
     RaiiFile vRf(fd);
     for (auto &[vType, lcn, num, sFile] : vecReqs) {
         printf(
-            "[type = %s, lcn = %" PRIu32 ", num = %" PRIu32 ", file = %s]:\n",
-            f_aTypeName[(int) vType], lcn, num, sFile.c_str()
+            "[type = %s, lcn = %" PRIu64 ", num = %" PRIu32 ", file = %s]:\n",
+            f_aTypeName[(int) vType], (uint64_t) lcn, num, sFile.c_str()
         );
         try {
             switch (vType) {
             case ReqType::kMeta: {
                 auto spcMeta = RdMap<MetaCluster>(fd, 0);
+                printf("uVersion = %" PRIu32 "\n", spcMeta->uVersion);
+                printf("uCluShift = %" PRIu32 "\n", spcMeta->uCluShift);
+                printf("uLcnBits = %" PRIu32 "\n", spcMeta->uLcnBits);
                 printf("cbSize = %" PRIu64 "\n", spcMeta->cbSize);
-                printf("ccTotal = %" PRIu32 "\n", spcMeta->ccTotal);
-                printf("ccUsed = %" PRIu32 "\n", spcMeta->ccUsed);
+                printf("ccTotal = %" PRIu64 "\n", (uint64_t) spcMeta->ccTotal);
+                printf("ccUsed = %" PRIu64 "\n", (uint64_t) spcMeta->ccUsed);
                 printf("ciTotal = %" PRIu32 "\n", spcMeta->ciTotal);
                 printf("ciUsed = %" PRIu32 "\n", spcMeta->ciUsed);
-                printf("lcnCluBmp = %" PRIu32 "\n", spcMeta->lcnCluBmp);
-                printf("ccCluBmp = %" PRIu32 "\n", spcMeta->ccCluBmp);
-                printf("lcnInoBmp = %" PRIu32 "\n", spcMeta->lcnInoBmp);
-                printf("ccInoBmp = %" PRIu32 "\n", spcMeta->ccInoBmp);
-                printf("lcnIno = %" PRIu32 "\n", spcMeta->lcnIno);
-                printf("ccIno = %" PRIu32 "\n", spcMeta->ccIno);
+                printf("lcnCluBmp = %" PRIu64 "\n", (uint64_t) spcMeta->lcnCluBmp);
+                printf("ccCluBmp = %" PRIu64 "\n", (uint64_t) spcMeta->ccCluBmp);
+                printf("lcnInoBmp = %" PRIu64 "\n", (uint64_t) spcMeta->lcnInoBmp);
+                printf("ccInoBmp = %" PRIu64 "\n", (uint64_t) spcMeta->ccInoBmp);
+                printf("lcnIno = %" PRIu64 "\n", (uint64_t) spcMeta->lcnIno);
+                printf("ccIno = %" PRIu64 "\n", (uint64_t) spcMeta->ccIno);
+                printf("iRefCnt.ccSize = %" PRIu32 "\n", spcMeta->iRefCnt.ccSize);
+                printf("iDedup.ccSize = %" PRIu32 "\n", spcMeta->iDedup.ccSize);
                 break;
             }
             case ReqType::kBitmap: {
                 auto spcMeta = RdMap<MetaCluster>(fd, 0);
-                uint32_t ccUsed = spcMeta->ccTotal;
-                for (uint32_t i = 0; i < spcMeta->ccCluBmp; ++i) {
+                Lcn ccUsed = spcMeta->ccTotal;
+                for (Lcn i = 0; i < spcMeta->ccCluBmp; ++i) {
                     auto spc = RdMap<BitmapCluster>(fd, spcMeta->lcnCluBmp + i);
                     for (uint32_t j = 0; j < kcqPerClu; ++j)
                         for (uint32_t k = 0; k < 64; ++k)
@@ -203,16 +230,16 @@ int main(int ncArg, char *ppszArgs[]) {
                                 --ccUsed;
                 }
                 uint32_t ciUsed = spcMeta->ciTotal;
-                for (uint32_t i = 0; i < spcMeta->ccInoBmp; ++i) {
+                for (Lcn i = 0; i < spcMeta->ccInoBmp; ++i) {
                     auto spc = RdMap<BitmapCluster>(fd, spcMeta->lcnInoBmp + i);
                     for (uint32_t j = 0; j < kcqPerClu; ++j)
                         for (uint32_t k = 0; k < 64; ++k)
                             if (!(spc->aBmp[j] & uint64_t {1} << k))
                                 --ciUsed;
                 }
-                printf("(meta) ccTotal = %" PRIu32 "\n", spcMeta->ccTotal);
-                printf("(meta) ccUsed = %" PRIu32 "\n", spcMeta->ccUsed);
-                printf("( bmp) ccUsed = %" PRIu32 "\n", ccUsed);
+                printf("(meta) ccTotal = %" PRIu64 "\n", (uint64_t) spcMeta->ccTotal);
+                printf("(meta) ccUsed = %" PRIu64 "\n", (uint64_t) spcMeta->ccUsed);
+                printf("( bmp) ccUsed = %" PRIu64 "\n", (uint64_t) ccUsed);
                 printf("(meta) ciTotal = %" PRIu32 "\n", spcMeta->ciTotal);
                 printf("(meta) ciUsed = %" PRIu32 "\n", spcMeta->ciUsed);
                 printf("( bmp) ciUsed = %" PRIu32 "\n", ciUsed);
@@ -222,7 +249,7 @@ int main(int ncArg, char *ppszArgs[]) {
             }
             case ReqType::kIndex: {
                 auto spc = RdMap<IndexCluster>(fd, lcn);
-                printf("lcn = %" PRIu32 "\n", spc->aLcns[num]);
+                printf("lcn = %" PRIu64 "\n", (uint64_t) spc->aLcns[num]);
                 break;
             }
             case ReqType::kInode: {
@@ -240,8 +267,8 @@ int main(int ncArg, char *ppszArgs[]) {
                 if (vcn >= spcMeta->ccIno) {
                     fprintf(
                         stderr,
-                        "Requested vcn is beyond the total inode cluster count (%" PRIu32 " > %" PRIu32 ").",
-                        vcn, spcMeta->ccIno
+                        "Requested vcn is beyond the total inode cluster count (%" PRIu32 " > %" PRIu64 ").",
+                        vcn, (uint64_t) spcMeta->ccIno
                     );
                 }
                 auto lcn = spcMeta->lcnIno + vcn;
@@ -252,23 +279,38 @@ int main(int ncArg, char *ppszArgs[]) {
                 printf("uMode = %06" PRIo16 "\n", pi->uMode);
                 printf("cLink = %" PRIu32 "\n", pi->cLink);
                 for (uint32_t i = 0; i < kccIdx0; ++i)
-                    printf("lcnIdx0[%" PRIu32 "] = %" PRIu32 "\n", i, pi->lcnIdx0[i]);
-                printf("lcnIdx1 = %" PRIu32 "\n", pi->lcnIdx1);
-                printf("lcnIdx2 = %" PRIu32 "\n", pi->lcnIdx2);
-                printf("lcnIdx3 = %" PRIu32 "\n", pi->lcnIdx3);
+                    printf("lcnIdx0[%" PRIu32 "] = %" PRIu64 "\n", i, (uint64_t) pi->lcnIdx0[i]);
+                printf("lcnIdx1 = %" PRIu64 "\n", (uint64_t) pi->lcnIdx1);
+                printf("lcnIdx2 = %" PRIu64 "\n", (uint64_t) pi->lcnIdx2);
+                printf("lcnIdx3 = %" PRIu64 "\n", (uint64_t) pi->lcnIdx3);
                 break;
             }
             case ReqType::kDir: {
+                if (!RdMap<MetaCluster>(fd, 0)->uVersion) {
+                    auto spc = RdMap<DirClusterV0>(fd, lcn);
+                    auto pe = &spc->aEnts[num];
+                    printf("linFile = %" PRIu32 "\n", pe->linFile);
+                    printf("lenNext = %" PRIu32 "\n", pe->lenNext);
+                    printf("lenChild = %" PRIu32 "\n", pe->lenChild);
+                    printf("uMode = %06" PRIo16 "\n", pe->uMode);
+                    printf("byKey = %" PRIu8 "\n", pe->byKey);
+                    printf("bExist = %s", pe->bExist ? "true" : "false");
+                    break;
+                }
                 auto spc = RdMap<DirCluster>(fd, lcn);
                 auto pe = &spc->aEnts[num];
                 printf("linFile = %" PRIu32 "\n", pe->linFile);
                 printf("lenNext = %" PRIu32 "\n", pe->lenNext);
                 printf("lenChild = %" PRIu32 "\n", pe->lenChild);
+                printf("lenFan = %" PRIu32 "\n", pe->lenFan);
                 printf("uMode = %06" PRIo16 "\n", pe->uMode);
-                if (isprint((int) pe->byKey))
-                    printf("byKey = %" PRIu8 " \'%c\'\n", pe->byKey, (char) pe->byKey);
-                else
-                    printf("byKey = %" PRIu8 "\n", pe->byKey);
+                printf("cbKey = %" PRIu8 "\n", pe->cbKey);
+                for (uint32_t i = 0; i < pe->cbKey && i < kcbDirKey; ++i) {
+                    if (isprint((int) pe->abyKey[i]))
+                        printf("abyKey[%" PRIu32 "] = %" PRIu8 " \'%c\'\n", i, pe->abyKey[i], (char) pe->abyKey[i]);
+                    else
+                        printf("abyKey[%" PRIu32 "] = %" PRIu8 "\n", i, pe->abyKey[i]);
+                }
                 printf("bExist = %s", pe->bExist ? "true" : "false");
                 break;
             }
@@ -294,4 +336,11 @@ int main(int ncArg, char *ppszArgs[]) {
         }
         printf("\n");
     }
+    return 0;
+}
+
+#if XXFS_IS_DEFAULT
+int main(int ncArg, char *ppszArgs[]) {
+    return xxfs::CluXxMain(ncArg, ppszArgs);
 }
+#endif
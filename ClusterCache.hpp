@@ -5,7 +5,7 @@
 
 #include "Raii.hpp"
 
-namespace xxfs {
+namespace xxfs { inline namespace XXFS_CLU_NS {
 
 template<uint32_t kCapacity>
 class ClusterCache : NoCopyMove {
@@ -21,7 +21,7 @@ public:
     }
 
     template<class tObj>
-    inline ShrPtr<tObj> At(uint32_t lcn) noexcept {
+    inline ShrPtr<tObj> At(Lcn lcn) noexcept {
         auto it = x_map.find(lcn);
         uint32_t idx;
         if (it == x_map.end()) {
@@ -42,7 +42,7 @@ public:
         return std::reinterpret_pointer_cast<tObj>(x_aMapped[idx]);
     }
 
-    inline void Touch(uint32_t lcn) noexcept {
+    inline void Touch(Lcn lcn) noexcept {
         auto it = x_map.find(lcn);
         if (it == x_map.end())
             return;
@@ -52,7 +52,7 @@ public:
         assert(x_map.size() <= (size_t) kCapacity);
     }
 
-    inline void Remove(uint32_t lcn) noexcept {
+    inline void Remove(Lcn lcn) noexcept {
         auto it = x_map.find(lcn);
         if (it == x_map.end())
             return;
@@ -97,12 +97,12 @@ private:
 private:
     int x_fd;
     X_Node x_aLinked[kCapacity + 1];
-    uint32_t x_aLcn[kCapacity];
+    Lcn x_aLcn[kCapacity];
     ShrPtr<void> x_aMapped[kCapacity];
-    std::unordered_map<uint32_t, uint32_t> x_map;
+    std::unordered_map<Lcn, uint32_t> x_map;
 
 };
 
-}
+}}
 
 #endif
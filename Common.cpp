@@ -1,6 +1,6 @@
 #include "Common.hpp"
 
-namespace xxfs {
+namespace xxfs { inline namespace XXFS_CLU_NS {
 
 namespace {
 
@@ -11,12 +11,21 @@ static_assert(IsCluster<MetaCluster>);
 static_assert(IsCluster<BitmapCluster>);
 static_assert(IsCluster<IndexCluster>);
 static_assert(IsCluster<InodeCluster>);
+static_assert(IsCluster<RefCntCluster>);
+static_assert(IsCluster<DedupCluster>);
 static_assert(IsCluster<DirCluster>);
+static_assert(IsCluster<DirIdxCluster>);
 static_assert(IsCluster<ByteCluster>);
 
+static_assert(kccIdx0 % kccCmpUnit == 0 && kcnPerClu % kccCmpUnit == 0);
 static_assert(kcbCluSize >= PATH_MAX);
-static_assert(kcePerClu >= NAME_MAX);
+static_assert(kcbNameBuf > NAME_MAX);
+static_assert(sizeof(DirFan) == sizeof(DirEnt) && sizeof(DirFanPart) == sizeof(DirEnt));
 static_assert(sizeof(uint64_t) >= sizeof(uintptr_t));
+// ProbeBuild reads them before the build is known
+static_assert(offsetof(MetaCluster, uVersion) == 184);
+static_assert(offsetof(MetaCluster, uCluShift) == 188);
+static_assert(offsetof(MetaCluster, uLcnBits) == 192);
 
 }
 
@@ -29,16 +38,39 @@ void FatalException::ShowWhat(FILE *pFile) const noexcept {
 
 void CheckPageSize() {
     auto ncbPageSize = sysconf(_SC_PAGESIZE);
-    if (ncbPageSize != (long) kcbCluSize) {
+    if ((long) kcbCluSize % ncbPageSize) {
         fprintf(
             stderr,
-            "Warning: Actual page size (%ld B) does not equal to predefined page size (%ld B)",
+            "Warning: Actual page size (%ld B) does not divide the cluster size (%ld B)",
             ncbPageSize,
             (long) kcbCluSize
         );
     }
 }
 
+std::pair<uint32_t, uint32_t> ProbeBuild(const char *pszPath) noexcept {
+    // the head of the meta cluster up to uLcnBits is laid out alike for every build
+    uint8_t abyHead[offsetof(MetaCluster, uLcnBits) + sizeof(uint32_t)];
+    auto fd = open(pszPath, O_RDONLY);
+    if (fd == -1)
+        return {0, 0};
+    auto cbRead = pread(fd, abyHead, sizeof(abyHead), 0);
+    close(fd);
+    if (cbRead != (ssize_t) sizeof(abyHead))
+        return {0, 0};
+    uint64_t uSign;
+    uint32_t uVersion;
+    uint32_t uCluShift;
+    uint32_t uLcnBits;
+    memcpy(&uSign, abyHead + offsetof(MetaCluster, uSign), sizeof(uSign));
+    memcpy(&uVersion, abyHead + offsetof(MetaCluster, uVersion), sizeof(uVersion));
+    memcpy(&uCluShift, abyHead + offsetof(MetaCluster, uCluShift), sizeof(uCluShift));
+    memcpy(&uLcnBits, abyHead + offsetof(MetaCluster, uLcnBits), sizeof(uLcnBits));
+    if (uSign != kSign)
+        return {0, 0};
+    return {uVersion >= 2 ? uCluShift : kCluShiftV0, uVersion >= 3 ? uLcnBits : kLcnBitsV0};
+}
+
 MetaResult FillMeta(MetaCluster *pcMeta, size_t cbSize) {
     if (cbSize > kcbMaxSize)
         return MetaResult::kTooLarge;
@@ -46,10 +78,11 @@ MetaResult FillMeta(MetaCluster *pcMeta, size_t cbSize) {
         return MetaResult::kTooSmall;
     if (cbSize % kcbCluSize)
         return MetaResult::kPartial;
-    auto ccTotal = (uint32_t) (cbSize / kcbCluSize);
+    auto ccTotal = (Lcn) (cbSize / kcbCluSize);
     auto cqCluBmp = (ccTotal + 63) / 64;
     auto ccCluBmp = (cqCluBmp + kcqPerClu - 1) / kcqPerClu;
-    auto ciUpper = ccTotal - ccCluBmp;
+    // lins are 32-bit, 64-bit builds keep the search below overflow
+    auto ciUpper = (uint32_t) std::min<Lcn>(ccTotal - ccCluBmp, kLcnBits == 32 ? UINT32_MAX : INT32_MAX);
     uint32_t ciTotal = 0;
     while (ciTotal + 1 < ciUpper) {
         auto ci = (ciTotal + ciUpper) / 2;
@@ -66,7 +99,7 @@ MetaResult FillMeta(MetaCluster *pcMeta, size_t cbSize) {
     auto cqInoBmp =  (ciTotal + 63) / 64;
     auto ccInoBmp = (cqInoBmp + kcqPerClu - 1) / kcqPerClu;
     auto ccIno =  (ciTotal + kciPerClu - 1) / kciPerClu;
-    auto lcnCluBmp = 1;
+    Lcn lcnCluBmp = 1;
     auto lcnInoBmp = ccCluBmp + lcnCluBmp;
     auto lcnIno = ccInoBmp + lcnInoBmp;
     auto ccUsed = ccIno + lcnIno;
@@ -83,6 +116,11 @@ MetaResult FillMeta(MetaCluster *pcMeta, size_t cbSize) {
     pcMeta->ccIno = ccIno;
     pcMeta->ccUsed = ccUsed;
     pcMeta->ciUsed = ciUsed;
+    memset(&pcMeta->iRefCnt, 0, sizeof(pcMeta->iRefCnt));
+    memset(&pcMeta->iDedup, 0, sizeof(pcMeta->iDedup));
+    pcMeta->uVersion = kVersion;
+    pcMeta->uCluShift = kCluShift;
+    pcMeta->uLcnBits = kLcnBits;
     memset(pcMeta->aZeros, 0, sizeof(pcMeta->aZeros));
     return MetaResult::kSuccess;
 }
@@ -103,4 +141,23 @@ void FillStat(FileStat &vStat, uint32_t lin, Inode *pi) noexcept {
     vStat.st_ctim = {};
 }
 
+uint64_t HashCluster(const ByteCluster *pc) noexcept {
+    // four independent lanes, folded at the end
+    uint64_t aLanes[4] = {
+        0x9e3779b97f4a7c15, 0xc2b2ae3d27d4eb4f, 0x165667b19e3779f9, 0x27d4eb2f165667c5
+    };
+    for (uint32_t i = 0; i < kcbCluSize; i += sizeof(aLanes)) {
+        for (uint32_t j = 0; j < 4; ++j) {
+            uint64_t u;
+            memcpy(&u, pc->aData + i + j * sizeof(u), sizeof(u));
+            aLanes[j] = (aLanes[j] ^ u) * 0xff51afd7ed558ccd;
+            aLanes[j] ^= aLanes[j] >> 29;
+        }
+    }
+    uint64_t uHash = 0;
+    for (auto u : aLanes)
+        uHash = (uHash ^ u) * 0xc4ceb9fe1a85ec53 + 0x9e3779b97f4a7c15;
+    return uHash ^ uHash >> 32;
 }
+
+}}
@@ -7,6 +7,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <inttypes.h>
 #include <linux/fs.h>
 #include <linux/limits.h>
@@ -27,18 +28,38 @@
 #include <functional>
 #include <limits>
 #include <list>
+#include <map>
 #include <memory>
 #include <new>
 #include <numeric>
 #include <string>
+#include <string_view>
+#include <tuple>
 #include <type_traits>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 #define CONCAT_(a_, b_) a_ ## b_
 #define CONCAT(a_, b_) CONCAT_(a_, b_)
 
-namespace xxfs {
+// the core is built once for each pair in XXFS_BUILDS: log2 of the cluster size, bits of an lcn
+// every build lives in its own inline namespace so that all of them link into one binary
+// main() of the tools is in the default build, it hands other images to their builds
+#define XXFS_BUILDS(X_) X_(12, 32) X_(12, 64) X_(16, 32) X_(16, 64)
+#define XXFS_CLU_SHIFT_DEFAULT 12
+#define XXFS_LCN_BITS_DEFAULT 32
+#ifndef XXFS_CLU_SHIFT
+#define XXFS_CLU_SHIFT XXFS_CLU_SHIFT_DEFAULT
+#endif
+#ifndef XXFS_LCN_BITS
+#define XXFS_LCN_BITS XXFS_LCN_BITS_DEFAULT
+#endif
+#define XXFS_BUILD_NS(s_, b_) CONCAT(CONCAT(Clu, s_), CONCAT(Lcn, b_))
+#define XXFS_CLU_NS XXFS_BUILD_NS(XXFS_CLU_SHIFT, XXFS_LCN_BITS)
+#define XXFS_IS_DEFAULT (XXFS_CLU_SHIFT == XXFS_CLU_SHIFT_DEFAULT && XXFS_LCN_BITS == XXFS_LCN_BITS_DEFAULT)
+
+namespace xxfs { inline namespace XXFS_CLU_NS {
 
 using FileStat = struct stat;
 using VfsStat = struct statvfs;
@@ -110,41 +131,37 @@ private:
 // ci => count of inode
 // ce => count of dirent
 // cq => count of qword
-// cn => count of index number (dword)
+// cn => count of index number (lcn)
 // cb => count of byte
 // cbi => count of bit
 
-constexpr size_t kcbMaxSize = 1ULL << 44; // 16 TiB
-constexpr size_t kcbMinSize = 6ULL << 12; // 24 KiB
+constexpr uint32_t kCluShift = XXFS_CLU_SHIFT;
+static_assert(kCluShift >= 12 && kCluShift <= 16);
+
+// the width of lcns and cluster counts on disk, vcns and lins stay 32-bit
+constexpr uint32_t kLcnBits = XXFS_LCN_BITS;
+#if XXFS_LCN_BITS == 64
+using Lcn = uint64_t;
+#elif XXFS_LCN_BITS == 32
+using Lcn = uint32_t;
+#else
+#error "XXFS_LCN_BITS must be 32 or 64"
+#endif
 
 constexpr uint32_t kSign = 0x0000000053465858; // "XXFS"
+// bumped when the on-disk layout changes, images of older versions are converted when mounted
+// 0: images from before the field existed, dirents hold one key byte each (DirEntV0)
+// 1: dirents of a radix trie (DirEnt)
+// 2: the cluster size is recorded in uCluShift, older images have 4 KiB clusters
+// 3: the lcn width is recorded in uLcnBits, older images have 32-bit lcns
+constexpr uint32_t kVersion = 3;
+constexpr uint32_t kCluShiftV0 = 12;
+constexpr uint32_t kLcnBitsV0 = 32;
 constexpr uint64_t kMagic0 = 0xfc6f4dfb3784ee9c;
 constexpr uint64_t kMagic1 = 0xbf602ab60041f70c;
 constexpr uint64_t kMagic2 = 0x612fcf459c80cfa2;
 
-constexpr uint32_t kcbCluSize = 4096;
-
-// Res: [MetaCluster] [ClusterBitmap] [InodeBitmap]
-
-struct MetaCluster {
-    // specified at creation
-    uint64_t uSign;
-    uint64_t cbSize;
-    uint32_t ccTotal;
-    uint32_t ciTotal;
-    uint32_t lcnCluBmp;
-    uint32_t ccCluBmp;
-    uint32_t lcnInoBmp;
-    uint32_t ccInoBmp;
-    uint32_t lcnIno;
-    uint32_t ccIno;
-    // updated dynamically
-    uint32_t ccUsed;
-    uint32_t ciUsed;
-    uint8_t aZeros[4040];
-};
-
-constexpr size_t kcbMetaStatic = offsetof(MetaCluster, ccUsed);
+constexpr uint32_t kcbCluSize = uint32_t {1} << kCluShift;
 
 constexpr uint32_t kcqPerClu = kcbCluSize / sizeof(uint64_t);
 
@@ -152,10 +169,10 @@ struct BitmapCluster {
     uint64_t aBmp[kcqPerClu];
 };
 
-constexpr uint32_t kcnPerClu = kcbCluSize / sizeof(uint32_t);
+constexpr uint32_t kcnPerClu = kcbCluSize / sizeof(Lcn);
 
 struct IndexCluster {
-    uint32_t aLcns[kcnPerClu];
+    Lcn aLcns[kcnPerClu];
 };
 
 constexpr uint32_t kccIdx0 = 8;
@@ -164,6 +181,9 @@ constexpr uint32_t kccIdx2 = kcnPerClu * kccIdx1;
 constexpr uint32_t kvcnIdx1 = kccIdx0;
 constexpr uint32_t kvcnIdx2 = kvcnIdx1 + kccIdx1;
 constexpr uint32_t kvcnIdx3 = kvcnIdx2 + kccIdx2;
+// the reach of the index tree, a file never grows past it
+// vcns are 32-bit, large clusters are capped at 2^31 per file
+constexpr uint64_t kcbMaxFile = std::min<uint64_t>(kvcnIdx3 + (uint64_t) kcnPerClu * kccIdx2, uint64_t {1} << 31) * kcbCluSize;
 
 struct Inode {
     uint64_t cbSize;
@@ -171,10 +191,17 @@ struct Inode {
     uint16_t uMode;
     uint16_t x_uPad;
     uint32_t cLink;
-    uint32_t lcnIdx0[kccIdx0];
-    uint32_t lcnIdx1;
-    uint32_t lcnIdx2;
-    uint32_t lcnIdx3;
+#if XXFS_LCN_BITS == 64
+    uint32_t x_uPad1;
+#endif
+    Lcn lcnIdx0[kccIdx0];
+    Lcn lcnIdx1;
+    Lcn lcnIdx2;
+    Lcn lcnIdx3;
+#if XXFS_LCN_BITS == 64
+    // an inode cluster holds a whole number of inodes
+    uint64_t x_auPad2[2];
+#endif
 
     constexpr bool IsDir() const noexcept {
         return S_ISDIR(uMode);
@@ -196,39 +223,225 @@ struct InodeCluster {
     Inode aInos[kciPerClu];
 };
 
+// Res: [MetaCluster] [ClusterBitmap] [InodeBitmap]
+
+// uVersion, uCluShift and uLcnBits are at the same offsets in every build, the tools probe them (see ProbeBuild)
+#if XXFS_LCN_BITS == 32
+struct MetaCluster {
+    // specified at creation
+    uint64_t uSign;
+    uint64_t cbSize;
+    uint32_t ccTotal;
+    uint32_t ciTotal;
+    uint32_t lcnCluBmp;
+    uint32_t ccCluBmp;
+    uint32_t lcnInoBmp;
+    uint32_t ccInoBmp;
+    uint32_t lcnIno;
+    uint32_t ccIno;
+    // updated dynamically
+    uint32_t ccUsed;
+    uint32_t ciUsed;
+    // extra reference counts of shared clusters (see RefCntCluster)
+    // a sparse file, zeros for images without shared clusters
+    Inode iRefCnt;
+    // hash index of data clusters for deduplication (see DedupCluster)
+    // a sparse file of ccTotal / kcdePerClu buckets
+    Inode iDedup;
+    // format version (see kVersion)
+    uint32_t uVersion;
+    // log2 of the cluster size
+    uint32_t uCluShift;
+    // bits of an lcn
+    uint32_t uLcnBits;
+    uint32_t x_uPad;
+    uint8_t aZeros[kcbCluSize - 72 - 2 * sizeof(Inode)];
+};
+#else
+// the layout of the 32-bit build with the fields widened, the inodes follow the probed fields
+struct MetaCluster {
+    // specified at creation
+    uint64_t uSign;
+    uint64_t cbSize;
+    Lcn ccTotal;
+    Lcn lcnCluBmp;
+    Lcn ccCluBmp;
+    Lcn lcnInoBmp;
+    Lcn ccInoBmp;
+    Lcn lcnIno;
+    Lcn ccIno;
+    uint32_t ciTotal;
+    uint32_t x_uPad0;
+    // updated dynamically
+    Lcn ccUsed;
+    uint32_t ciUsed;
+    uint8_t x_abyPad1[92];
+    uint32_t uVersion;
+    uint32_t uCluShift;
+    uint32_t uLcnBits;
+    uint32_t x_uPad2;
+    Inode iRefCnt;
+    Inode iDedup;
+    uint8_t aZeros[kcbCluSize - 200 - 2 * sizeof(Inode)];
+};
+#endif
+
+constexpr size_t kcbMetaStatic = offsetof(MetaCluster, ccUsed);
+
+constexpr uint32_t kcrPerClu = kcbCluSize / sizeof(uint32_t);
+
+// one counter for each lcn, the count of references besides the first one
+struct RefCntCluster {
+    uint32_t aRefs[kcrPerClu];
+};
+
+// an indexed cluster holds one reference for the index and is never written in place
+struct DedupEnt {
+    uint32_t uTag;  // high half of the hash
+    Lcn lcn;        // 0 if unused
+};
+
+constexpr uint32_t kcdePerClu = kcbCluSize / sizeof(DedupEnt);
+
+struct DedupCluster {
+    DedupEnt aEnts[kcdePerClu];
+};
+
+#if XXFS_LCN_BITS == 32
+// lcns are 32-bit and ~0 is kLcnCmp, ccTotal must fit in 32 bits
+constexpr size_t kcbMaxSize = ((1ULL << 32) - 1) << kCluShift; // 16 TiB of 4 KiB clusters
+#else
+// the dedup buckets of all lcns must fit in one file, they outgrow the reference counts
+constexpr size_t kcbMaxSize = kcbMaxFile / sizeof(DedupEnt) * kcbCluSize; // 128 TiB of 4 KiB clusters
+#endif
+constexpr size_t kcbMinSize = 6ULL << kCluShift; // 24 KiB of 4 KiB clusters
+
+// the longest name with the terminator
+constexpr uint32_t kcbNameBuf = 256;
+constexpr uint32_t kcbDirKey = 12;
+
+// a node of the radix trie, a chain of nodes holds a fragment longer than kcbDirKey
 struct DirEnt{
     // inode number to the entry if not root
     // number of entrys used if root
     uint32_t linFile;
     uint32_t lenNext;
     uint32_t lenChild;
+    uint32_t lenFan;    // the packed children (DirFan) if wide, 0 otherwise
     uint16_t uMode; // enough to hold perm and type
-    uint8_t byKey;
+    uint8_t cbKey;  // 0 if root, siblings differ in the first byte and are sorted by it
     bool bExist;
+    uint8_t abyKey[kcbDirKey];
 };
 
 constexpr uint32_t kcePerClu = kcbCluSize / sizeof(DirEnt);
-// constexpr uint32_t kcDirStkSize = 256; // used in dir operations
+
+// nodes with so many children pack them in fans besides the sibling list
+constexpr uint32_t kcFanMin = 8;
+constexpr uint32_t kcfPerFan = 16;
+constexpr uint32_t kcfPerPart = kcfPerFan / 2;
+
+// packed children of a wide node in place of a DirEnt, the keys are compared at once
+struct DirFan {
+    uint8_t abyKey[kcfPerFan];  // the first bytes of the children, 0 if the slot is unused
+    uint32_t alenPart[kcfPerFan / kcfPerPart];  // DirFanPart holding the children in the same order
+    uint32_t lenNext;
+    uint32_t uPad;
+};
+
+struct DirFanPart {
+    uint32_t alen[kcfPerPart];
+};
 
 struct DirCluster {
     DirEnt aEnts[kcePerClu];
 };
 
+// the layout of version 1
+static_assert(sizeof(DirEnt) == 32);
+
+// a node of the byte trie of version 0 images, only read to convert them
+struct DirEntV0 {
+    uint32_t linFile;
+    uint32_t lenNext;
+    uint32_t lenChild;
+    uint16_t uMode;
+    uint8_t byKey;
+    bool bExist;
+};
+
+constexpr uint32_t kcePerCluV0 = kcbCluSize / sizeof(DirEntV0);
+
+struct DirClusterV0 {
+    DirEntV0 aEnts[kcePerCluV0];
+};
+
+// hashed index of the trie edges of a large directory, open addressing
+// kept from kvcnDirIdx on in the directory file, the first key byte of the root entry holds log2(count of clusters) + 1
+struct DirIdxEnt {
+    uint32_t lenParent;
+    uint32_t lenChild;  // 0 if the slot is unused
+    uint8_t byKey;  // the first byte of the child
+    uint8_t aPad[7];
+};
+
+constexpr uint32_t kcdiPerClu = kcbCluSize / sizeof(DirIdxEnt);
+constexpr uint32_t kvcnDirIdx = kvcnIdx3;
+// directories with fewer entries go without the index
+constexpr uint32_t kceDirIdxMin = 16 * kcePerClu;
+
+struct DirIdxCluster {
+    DirIdxEnt aEnts[kcdiPerClu];
+};
+
 struct ByteCluster {
     uint8_t aData[kcbCluSize];
 };
 
+// speculative preallocation window for growing files (in clusters)
+constexpr uint32_t kccPreallocMin = std::max<uint32_t>((32 << 10) >> kCluShift, 1); // 32 KiB
+constexpr uint32_t kccPreallocMax = (16 << 20) >> kCluShift; // 16 MiB
+// the window never exceeds this fraction of the free clusters
+constexpr uint32_t kPreallocFreeDiv = 32;
+
+// delayed allocation: count of buffered clusters before a flush is forced
+constexpr uint32_t kccDelayMax = (16 << 20) >> kCluShift; // 16 MiB
+// writes go straight to clusters when the free clusters drop below this
+// the margin covers the index clusters needed by a flush
+constexpr uint32_t kccDelayFree = 4 * kccDelayMax;
+// the runs written by flushes of a file are synced by its fsync, or once there are this many
+constexpr size_t kcRunUnsynced = 1024;
+
+// transparent compression works on units of kccCmpUnit clusters aligned by vcn
+// a unit never spans two index arrays
+// a compressed unit keeps its data in the leading slots and kLcnCmp in the rest
+constexpr uint32_t kccCmpUnit = 8;          // 32 KiB
+constexpr Lcn kLcnCmp = ~Lcn {0};
+
+// head of the data of a compressed unit, followed by the compressed stream
+struct CmpHead {
+    uint32_t cbData;
+};
+
+// a decompressed unit
+struct CmpUnit {
+    ByteCluster aClus[kccCmpUnit];
+};
+
 enum class MetaResult {
     kSuccess,   // succeed to fill the meta cluster
     kTooLarge,  // the size is too large
     kTooSmall,  // the size is too small
-    kPartial,   // the size is not dividable by 4 KiB
+    kPartial,   // the size is not dividable by the cluster size
 };
 
 void CheckPageSize();
+// the cluster shift and the lcn width recorded in the image, {0, 0} if it is not readable or not xxfs
+std::pair<uint32_t, uint32_t> ProbeBuild(const char *pszPath) noexcept;
 MetaResult FillMeta(MetaCluster *pcMeta, size_t cbSize);
 void FillStat(FileStat &vStat, uint32_t lin, Inode *pi) noexcept;
+uint64_t HashCluster(const ByteCluster *pc) noexcept;
 
-}
+}}
 
 #endif
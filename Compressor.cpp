@@ -0,0 +1,137 @@
+#include "Common.hpp"
+
+#include "Compressor.hpp"
+
+namespace xxfs {
+
+namespace {
+
+constexpr uint32_t kcbMinMatch = 4;
+// the tail is always left as literals so that matching never reads past the end
+constexpr uint32_t kcbLastLits = 5;
+constexpr uint32_t kMaxOffset = 0xffff;
+constexpr uint32_t kcHashBits = 12;
+
+inline uint32_t X_Load32(const uint8_t *p) noexcept {
+    uint32_t u;
+    memcpy(&u, p, sizeof(u));
+    return u;
+}
+
+inline uint32_t X_Hash(uint32_t u) noexcept {
+    return (u * 2654435761u) >> (32 - kcHashBits);
+}
+
+// append an extended length, false if out of space
+inline bool X_PutLen(uint8_t *&pDst, uint8_t *pEnd, uint32_t len) noexcept {
+    for (; len >= 0xff; len -= 0xff) {
+        if (pDst == pEnd)
+            return false;
+        *pDst++ = 0xff;
+    }
+    if (pDst == pEnd)
+        return false;
+    *pDst++ = (uint8_t) len;
+    return true;
+}
+
+inline bool X_GetLen(const uint8_t *&pSrc, const uint8_t *pEnd, uint32_t &len) noexcept {
+    uint8_t by;
+    do {
+        if (pSrc == pEnd)
+            return false;
+        by = *pSrc++;
+        len += by;
+    } while (by == 0xff);
+    return true;
+}
+
+// literals followed by a match unless lenMatch is 0
+bool X_PutSeq(
+    uint8_t *&pDst, uint8_t *pEnd,
+    const uint8_t *pLits, uint32_t lenLits, uint32_t lenMatch, uint32_t uOff
+) noexcept {
+    if (pDst == pEnd)
+        return false;
+    auto pToken = pDst++;
+    *pToken = (uint8_t) (std::min(lenLits, 15u) << 4);
+    if (lenLits >= 15 && !X_PutLen(pDst, pEnd, lenLits - 15))
+        return false;
+    if ((size_t) (pEnd - pDst) < lenLits)
+        return false;
+    memcpy(pDst, pLits, lenLits);
+    pDst += lenLits;
+    if (!lenMatch)
+        return true;
+    if (pEnd - pDst < 2)
+        return false;
+    *pDst++ = (uint8_t) uOff;
+    *pDst++ = (uint8_t) (uOff >> 8);
+    lenMatch -= kcbMinMatch;
+    *pToken |= (uint8_t) std::min(lenMatch, 15u);
+    return lenMatch < 15 || X_PutLen(pDst, pEnd, lenMatch - 15);
+}
+
+}
+
+uint32_t Compress(const uint8_t *pSrc, uint32_t cbSrc, uint8_t *pDst, uint32_t cbDstMax) noexcept {
+    uint32_t aHash[1u << kcHashBits] {};
+    auto pOut = pDst;
+    auto pEnd = pDst + cbDstMax;
+    uint32_t uAnchor = 0;
+    uint32_t uPos = 0;
+    while (cbSrc >= kcbLastLits + kcbMinMatch && uPos <= cbSrc - kcbLastLits - kcbMinMatch) {
+        auto uSeq = X_Load32(pSrc + uPos);
+        auto &uRef = aHash[X_Hash(uSeq)];
+        auto uCand = uRef;
+        uRef = uPos;
+        if (uCand >= uPos || uPos - uCand > kMaxOffset || X_Load32(pSrc + uCand) != uSeq) {
+            ++uPos;
+            continue;
+        }
+        auto lenMatch = kcbMinMatch;
+        while (uPos + lenMatch < cbSrc - kcbLastLits && pSrc[uCand + lenMatch] == pSrc[uPos + lenMatch])
+            ++lenMatch;
+        if (!X_PutSeq(pOut, pEnd, pSrc + uAnchor, uPos - uAnchor, lenMatch, uPos - uCand))
+            return 0;
+        uPos += lenMatch;
+        uAnchor = uPos;
+    }
+    if (!X_PutSeq(pOut, pEnd, pSrc + uAnchor, cbSrc - uAnchor, 0, 0))
+        return 0;
+    return (uint32_t) (pOut - pDst);
+}
+
+bool Decompress(const uint8_t *pSrc, uint32_t cbSrc, uint8_t *pDst, uint32_t cbDst) noexcept {
+    auto pEnd = pSrc + cbSrc;
+    uint32_t cbOut = 0;
+    while (pSrc != pEnd) {
+        auto byToken = *pSrc++;
+        uint32_t lenLits = byToken >> 4;
+        if (lenLits == 15 && !X_GetLen(pSrc, pEnd, lenLits))
+            return false;
+        if ((size_t) (pEnd - pSrc) < lenLits || cbDst - cbOut < lenLits)
+            return false;
+        memcpy(pDst + cbOut, pSrc, lenLits);
+        pSrc += lenLits;
+        cbOut += lenLits;
+        if (pSrc == pEnd)
+            break;
+        if (pEnd - pSrc < 2)
+            return false;
+        uint32_t uOff = pSrc[0] | (uint32_t) pSrc[1] << 8;
+        pSrc += 2;
+        uint32_t lenMatch = byToken & 15;
+        if (lenMatch == 15 && !X_GetLen(pSrc, pEnd, lenMatch))
+            return false;
+        lenMatch += kcbMinMatch;
+        if (!uOff || uOff > cbOut || cbDst - cbOut < lenMatch)
+            return false;
+        // the match may overlap its own output
+        for (auto pFrom = pDst + cbOut - uOff, pTo = pDst + cbOut; lenMatch--; ++cbOut)
+            *pTo++ = *pFrom++;
+    }
+    return cbOut == cbDst;
+}
+
+}
@@ -0,0 +1,20 @@
+#ifndef XXFS_COMPRESSOR_HPP_
+#define XXFS_COMPRESSOR_HPP_
+
+#include "Common.hpp"
+
+namespace xxfs {
+
+// a byte oriented LZ77 codec in the manner of LZ4
+// sequence: token (4 bits literal length, 4 bits match length - 4)
+//           [literal length bytes] literals offset(le16) [match length bytes]
+// the last sequence carries literals only
+
+// returns the compressed size, 0 if it does not fit in cbDstMax
+uint32_t Compress(const uint8_t *pSrc, uint32_t cbSrc, uint8_t *pDst, uint32_t cbDstMax) noexcept;
+// returns false if the input is malformed or does not expand to exactly cbDst bytes
+bool Decompress(const uint8_t *pSrc, uint32_t cbSrc, uint8_t *pDst, uint32_t cbDst) noexcept;
+
+}
+
+#endif
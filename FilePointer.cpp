@@ -3,11 +3,11 @@
 #include "FilePointer.hpp"
 #include "Xxfs.hpp"
 
-namespace xxfs {
+namespace xxfs { inline namespace XXFS_CLU_NS {
 
 template<bool kAlloc>
 ShrPtr<void> FilePointer<kAlloc>::X_Seek(Xxfs *px, Inode *pi, uint32_t vcn) noexcept(!kAlloc) {
-    if (x_sp && vcn == x_vcn) {
+    if (x_sp && vcn == x_vcn && x_uGen == px->x_uShareGen) {
         px->Y_Touch(x_lcn);
         return x_sp;
     }
@@ -47,22 +47,39 @@ ShrPtr<void> FilePointer<kAlloc>::X_Seek(Xxfs *px, Inode *pi, uint32_t vcn) noex
 
 template<bool kAlloc>
 void FilePointer<kAlloc>::X_Seek0(
-    Xxfs *px, Inode *pi, uint32_t vcnOff, uint32_t vcn, uint32_t *pLcns
+    Xxfs *px, Inode *pi, uint32_t vcnOff, uint32_t vcn, Lcn *pLcns
 ) noexcept(!kAlloc) {
     x_vcn = vcnOff + vcn;
     x_sp.reset();
     if (pLcns) {
-        if (kAlloc && !pLcns[vcn])
-            x_sp = px->Y_FileAllocClu<void>(pi, pLcns[vcn]);
+        auto pUnit = pLcns + vcn / kccCmpUnit * kccCmpUnit;
+        auto bCmp = pUnit[kccCmpUnit - 1] == kLcnCmp;
+        if (kAlloc && bCmp) {
+            // writes go to plain clusters
+            px->Y_CmpExpand(pi, pUnit);
+            bCmp = false;
+        }
+        // keep the file contiguous: follow the previous cluster
+        auto lcnPrev = vcn && pLcns[vcn - 1] ? pLcns[vcn - 1] : x_lcn;
+        auto lcnHint = x_lcnHint ? x_lcnHint : lcnPrev && lcnPrev != kLcnCmp ? lcnPrev + 1 : 0;
+        if (bCmp)
+            x_sp = px->Y_CmpMap(pUnit, vcn % kccCmpUnit);
+        else if (kAlloc && !pLcns[vcn]) {
+            x_sp = px->Y_FileAllocClu<void>(pi, pLcns[vcn], lcnHint);
+            x_lcnHint = 0;
+        }
+        else if (kAlloc && px->Y_RefGet(pLcns[vcn]))
+            x_sp = px->Y_FileCowClu(pi, pLcns[vcn], lcnHint);
         else if (pLcns[vcn])
             x_sp = px->Y_Map<void>(pLcns[vcn]);
-        x_lcn = pLcns[vcn];
+        x_lcn = bCmp ? 0 : pLcns[vcn];
     }
+    x_uGen = px->x_uShareGen;
 }
 
 template<bool kAlloc>
 void FilePointer<kAlloc>::X_Seek1(
-    Xxfs *px, Inode *pi, uint32_t vcnOff, uint32_t vcn, uint32_t *pLcns
+    Xxfs *px, Inode *pi, uint32_t vcnOff, uint32_t vcn, Lcn *pLcns
 ) noexcept(!kAlloc) {
     auto vcn1 = vcn % kccIdx1;
     auto idx1 = vcn / kccIdx1;
@@ -80,7 +97,7 @@ void FilePointer<kAlloc>::X_Seek1(
 
 template<bool kAlloc>
 void FilePointer<kAlloc>::X_Seek2(
-    Xxfs *px, Inode *pi, uint32_t vcnOff, uint32_t vcn, uint32_t *pLcns
+    Xxfs *px, Inode *pi, uint32_t vcnOff, uint32_t vcn, Lcn *pLcns
 ) noexcept(!kAlloc) {
     auto vcn2 = vcn % kccIdx2;
     auto idx2 = vcn / kccIdx2;
@@ -99,4 +116,4 @@ void FilePointer<kAlloc>::X_Seek2(
 template class FilePointer<false>;
 template class FilePointer<true>;
 
-}
+}}
@@ -5,7 +5,7 @@
 
 #include "Raii.hpp"
 
-namespace xxfs {
+namespace xxfs { inline namespace XXFS_CLU_NS {
 
 class Xxfs;
 
@@ -22,11 +22,29 @@ public:
         ShrSync(x_sp3);
     }
 
+    // forget every mapping, required after the clusters of the file are freed
+    inline void Reset() noexcept {
+        x_sp.reset();
+        x_sp1.reset();
+        x_sp2.reset();
+        x_sp3.reset();
+    }
+
     template<class tObj>
     inline ShrPtr<tObj> Get() noexcept {
         return std::reinterpret_pointer_cast<tObj>(x_sp);
     }
 
+    // lcn of the data cluster of the last seek
+    inline Lcn CurLcn() const noexcept {
+        return x_lcn;
+    }
+
+    // preferred lcn for the next data cluster allocated
+    inline void Hint(Lcn lcn) noexcept {
+        x_lcnHint = lcn;
+    }
+
     template<class tObj>
     inline ShrPtr<tObj> Seek(Xxfs *px, Inode *pi, uint32_t vcn) noexcept(!kAlloc) {
         auto &&sp = X_Seek(px, pi, vcn);
@@ -35,27 +53,30 @@ public:
 
 private:
     ShrPtr<void> X_Seek(Xxfs *px, Inode *pi, uint32_t vcn) noexcept(!kAlloc);
-    void X_Seek0(Xxfs *px, Inode *pi, uint32_t vcnOff, uint32_t vcn, uint32_t *pLcns) noexcept(!kAlloc);
-    void X_Seek1(Xxfs *px, Inode *pi, uint32_t vcnOff, uint32_t vcn, uint32_t *pLcns) noexcept(!kAlloc);
-    void X_Seek2(Xxfs *px, Inode *pi, uint32_t vcnOff, uint32_t vcn, uint32_t *pLcns) noexcept(!kAlloc);
+    void X_Seek0(Xxfs *px, Inode *pi, uint32_t vcnOff, uint32_t vcn, Lcn *pLcns) noexcept(!kAlloc);
+    void X_Seek1(Xxfs *px, Inode *pi, uint32_t vcnOff, uint32_t vcn, Lcn *pLcns) noexcept(!kAlloc);
+    void X_Seek2(Xxfs *px, Inode *pi, uint32_t vcnOff, uint32_t vcn, Lcn *pLcns) noexcept(!kAlloc);
 
 private:
     ShrPtr<void> x_sp;
     ShrPtr<IndexCluster> x_sp1;
     ShrPtr<IndexCluster> x_sp2;
     ShrPtr<IndexCluster> x_sp3;
-    uint32_t x_lcn = 0;
-    uint32_t x_lcn1 = 0;
-    uint32_t x_lcn2 = 0;
+    Lcn x_lcn = 0;
+    Lcn x_lcn1 = 0;
+    Lcn x_lcn2 = 0;
     uint32_t x_vcn = 0;
     uint32_t x_vcn1 = 0;
     uint32_t x_vcn2 = 0;
+    // Xxfs::x_uShareGen when x_sp was mapped
+    uint32_t x_uGen = 0;
+    Lcn x_lcnHint = 0;
 
 };
 
 using FilePtrR = FilePointer<false>;
 using FilePtrW = FilePointer<true>;
 
-}
+}}
 
 #endif
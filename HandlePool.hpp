@@ -0,0 +1,53 @@
+#ifndef XXFS_HANDLE_POOL_HPP_
+#define XXFS_HANDLE_POOL_HPP_
+
+#include "Common.hpp"
+
+namespace xxfs { inline namespace XXFS_CLU_NS {
+
+// recycles the storage of released handles, opens and releases come at a high rate
+// at most kCapacity free blocks are kept, the rest go back to the heap
+template<class tObj>
+class HandlePool : NoCopyMove {
+public:
+    constexpr static size_t kCapacity = 1024;
+
+public:
+    inline HandlePool() {
+        x_vecFree.reserve(kCapacity);
+    }
+
+    inline ~HandlePool() {
+        for (auto p : x_vecFree)
+            ::operator delete(p);
+    }
+
+    template<class... tArgs>
+    inline tObj *New(tArgs &&...vArgs) {
+        static_assert(std::is_nothrow_constructible_v<tObj, tArgs...>);
+        void *p;
+        if (x_vecFree.empty())
+            p = ::operator new(sizeof(tObj));
+        else {
+            p = x_vecFree.back();
+            x_vecFree.pop_back();
+        }
+        return new (p) tObj(std::forward<tArgs>(vArgs)...);
+    }
+
+    inline void Delete(tObj *pObj) noexcept {
+        pObj->~tObj();
+        if (x_vecFree.size() < kCapacity)
+            x_vecFree.emplace_back(pObj);
+        else
+            ::operator delete(pObj);
+    }
+
+private:
+    std::vector<void *> x_vecFree;
+
+};
+
+}}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef XXFS_INODE_CACHE_HPP_
+#define XXFS_INODE_CACHE_HPP_
+
+#include "Common.hpp"
+
+namespace xxfs { inline namespace XXFS_CLU_NS {
+
+// lookup counts of the inodes the kernel holds, an inode absent here is not looked up
+class InodeCache : NoCopyMove {
+public:
+    inline void IncLookup(uint32_t lin) noexcept {
+        ++x_map[lin];
+    }
+
+    // returns true if the count drops to 0 by this call
+    inline bool DecLookup(uint32_t lin, uint64_t cLookup) noexcept {
+        auto it = x_map.find(lin);
+        if (it == x_map.end())
+            return false;
+        if (it->second > cLookup) {
+            it->second -= cLookup;
+            return false;
+        }
+        x_map.erase(it);
+        return true;
+    }
+
+    inline bool IsLooked(uint32_t lin) const noexcept {
+        return x_map.count(lin);
+    }
+
+    inline std::vector<uint32_t> Looked() const {
+        std::vector<uint32_t> vecLin;
+        vecLin.reserve(x_map.size());
+        for (auto &vEnt : x_map)
+            vecLin.emplace_back(vEnt.first);
+        return vecLin;
+    }
+
+private:
+    std::unordered_map<uint32_t, uint64_t> x_map;
+
+};
+
+}}
+
+#endif
@@ -3,22 +3,29 @@
 #include "ClusterCache.hpp"
 #include "Raii.hpp"
 
-namespace xxfs { namespace {
+namespace xxfs {
+
+// the entries of the builds for every cluster size and lcn width
+#define X_ENTRY(s_, b_) namespace XXFS_BUILD_NS(s_, b_) { int MkXxfsMain(int ncArg, char *ppszArgs[]); }
+XXFS_BUILDS(X_ENTRY)
+#undef X_ENTRY
+
+inline namespace XXFS_CLU_NS { namespace {
 using Cache = ClusterCache<4096>;
 
-void WriteCluster(Cache &vCache, uint32_t lcn, uint32_t vcn, int nVal) {
-    for (uint32_t i = 0; i < vcn; ++i) {
+void WriteCluster(Cache &vCache, Lcn lcn, Lcn vcn, int nVal) {
+    for (Lcn i = 0; i < vcn; ++i) {
         auto spc = vCache.At<BitmapCluster>(lcn + i);
         memset(spc.get(), nVal, kcbCluSize);
     }
 }
 
-void WriteBitmap(Cache &vCache, uint32_t lcnBmp, uint32_t cbi, int nVal) {
+void WriteBitmap(Cache &vCache, Lcn lcnBmp, Lcn cbi, int nVal) {
     auto vbi = cbi % 64;
     auto lqw = cbi / 64;
     auto vqw = lqw % kcqPerClu;
     auto vcn = lqw / kcqPerClu;
-    for (uint32_t i = 0; i < vcn; ++i) {
+    for (Lcn i = 0; i < vcn; ++i) {
         auto spc = vCache.At<BitmapCluster>(lcnBmp + i);
         memset(spc.get(), nVal, kcbCluSize);
     }
@@ -31,7 +38,7 @@ void WriteBitmap(Cache &vCache, uint32_t lcnBmp, uint32_t cbi, int nVal) {
         spc->aBmp[vqw] &= ~uMask;
 }
 
-void BitmapAlloc(Cache &vCache, uint32_t lcnBmp, uint32_t lbi) {
+void BitmapAlloc(Cache &vCache, Lcn lcnBmp, Lcn lbi) {
     auto vbi = lbi % 64;
     auto lqw = lbi / 64;
     auto vqw = lqw % kcqPerClu;
@@ -40,17 +47,44 @@ void BitmapAlloc(Cache &vCache, uint32_t lcnBmp, uint32_t lbi) {
     spc->aBmp[vqw] |= uint64_t {1} << vbi;
 }
 
-}}
+// run the build for another cluster size or lcn width, it parses the arguments again
+int RunFor(uint32_t uShift, uint32_t uLcnBits, int ncArg, char *ppszArgs[]) {
+    optind = 1;
+#define X_RUN(s_, b_) \
+    if (uShift == s_ && uLcnBits == b_) \
+        return XXFS_BUILD_NS(s_, b_)::MkXxfsMain(ncArg, ppszArgs);
+    XXFS_BUILDS(X_RUN)
+#undef X_RUN
+    fprintf(stderr, "The cluster size or the lcn width is not supported.\n");
+    return -1;
+}
+
+}}}
 
-int main(int ncArg, char *ppszArgs[]) {
-    using namespace xxfs;
-    if (ncArg != 2) {
+int xxfs::XXFS_CLU_NS::MkXxfsMain(int ncArg, char *ppszArgs[]) {
+    uint32_t uShift = XXFS_CLU_SHIFT_DEFAULT;
+    uint32_t uLcnBits = XXFS_LCN_BITS_DEFAULT;
+    bool bIncorrect = false;
+    int chOpt;
+    while ((chOpt = getopt(ncArg, ppszArgs, ":c:l:")) != -1) {
+        if (chOpt == 'c') {
+            auto cbClu = strtoul(optarg, nullptr, 10);
+            uShift = cbClu && !(cbClu & (cbClu - 1)) ? (uint32_t) __builtin_ctzl(cbClu) : 0;
+        }
+        else if (chOpt == 'l')
+            uLcnBits = (uint32_t) strtoul(optarg, nullptr, 10);
+        else
+            bIncorrect = true;
+    }
+    if (bIncorrect || optind + 1 != ncArg) {
         fprintf(stderr, "Incorrect argument.\n");
-        printf("\nUsage: %s path\n", ppszArgs[0]);
+        printf("\nUsage: %s [-c cluster_size] [-l lcn_bits] path\n", ppszArgs[0]);
         return -1;
     }
+    if (uShift != kCluShift || uLcnBits != kLcnBits)
+        return RunFor(uShift, uLcnBits, ncArg, ppszArgs);
     CheckPageSize();
-    auto fd = open(ppszArgs[1], O_RDWR);
+    auto fd = open(ppszArgs[optind], O_RDWR);
     if (fd == -1) {
         fprintf(stderr, "Failed to open the file.\n");
         return -1;
@@ -68,12 +102,14 @@ int main(int ncArg, char *ppszArgs[]) {
         switch (vRes) {
         case MetaResult::kTooLarge:
             fprintf(stderr, "The file is too large (%zu B over %zu B).\n", (size_t) vStat.st_size, kcbMaxSize);
+            if (kLcnBits == 32)
+                fprintf(stderr, "Larger images take 64-bit lcns (-l 64).\n");
             return -1;
         case MetaResult::kTooSmall:
             fprintf(stderr, "The file is too small (%zu B less than %zu B).\n", (size_t) vStat.st_size, kcbMinSize);
             return -1;
         case MetaResult::kPartial:
-            fprintf(stderr, "The file\'s size is not dividable by 4KiB block size.\n");
+            fprintf(stderr, "The file\'s size is not dividable by the cluster size (%" PRIu32 " B).\n", kcbCluSize);
             return -1;
         default:
             break;
@@ -82,7 +118,7 @@ int main(int ncArg, char *ppszArgs[]) {
         WriteBitmap(vCache, spcMeta->lcnCluBmp, spcMeta->ccTotal, 0x00);
         WriteCluster(vCache, spcMeta->lcnInoBmp, spcMeta->ccInoBmp, 0xff);
         WriteBitmap(vCache, spcMeta->lcnInoBmp, spcMeta->ciTotal, 0x00);
-        for (uint32_t i = 0; i < spcMeta->ccUsed; ++i)
+        for (Lcn i = 0; i < spcMeta->ccUsed; ++i)
             BitmapAlloc(vCache, spcMeta->lcnCluBmp, i);
         // spcMeta->ciUsed is expected to be 1, that's the root directory
         for (uint32_t i = 0; i < spcMeta->ciUsed; ++i) {
@@ -100,9 +136,9 @@ int main(int ncArg, char *ppszArgs[]) {
             (uint64_t) kcbCluSize * (spcMeta->ccTotal - spcMeta->ccUsed)
         );
         printf(
-            "%-8s %14" PRIu32 " %14" PRIu32 " %14" PRIu32 "\n",
-            "Cluster", spcMeta->ccTotal, spcMeta->ccUsed,
-            spcMeta->ccTotal - spcMeta->ccUsed
+            "%-8s %14" PRIu64 " %14" PRIu64 " %14" PRIu64 "\n",
+            "Cluster", (uint64_t) spcMeta->ccTotal, (uint64_t) spcMeta->ccUsed,
+            (uint64_t) (spcMeta->ccTotal - spcMeta->ccUsed)
         );
         printf(
             "%-8s %14" PRIu32 " %14" PRIu32 " %14" PRIu32 "\n",
@@ -116,3 +152,9 @@ int main(int ncArg, char *ppszArgs[]) {
     }
     return 0;
 }
+
+#if XXFS_IS_DEFAULT
+int main(int ncArg, char *ppszArgs[]) {
+    return xxfs::MkXxfsMain(ncArg, ppszArgs);
+}
+#endif
@@ -0,0 +1,104 @@
+#ifndef XXFS_NAME_FILTER_HPP_
+#define XXFS_NAME_FILTER_HPP_
+
+#include "Common.hpp"
+
+namespace xxfs { inline namespace XXFS_CLU_NS {
+
+// parent inode number => Bloom filter of the names in the directory, least recently used dropped first
+// a filter holds a superset of the names: every name inserted must be added, removal leaves it
+// a directory without a filter may hold any name
+class NameFilter : NoCopyMove {
+public:
+    constexpr static size_t kCapacity = 256;
+    constexpr static uint32_t kcBitsPerName = 8;
+    constexpr static uint32_t kcProbes = 4;
+    constexpr static uint32_t kcMinNames = 64;
+
+public:
+    inline bool Has(uint32_t linPar) const noexcept {
+        return x_map.count(linPar);
+    }
+
+    // false if the name is surely absent
+    inline bool MayHave(uint32_t linPar, std::string_view svName) noexcept {
+        auto it = x_map.find(linPar);
+        if (it == x_map.end())
+            return true;
+        x_lst.splice(x_lst.begin(), x_lst, it->second);
+        auto &vFlt = *it->second;
+        auto uMask = (uint32_t) (vFlt.vecBits.size() * 64 - 1);
+        auto [uHash, uStep] = X_Hash(svName);
+        for (uint32_t i = 0; i < kcProbes; ++i, uHash += uStep) {
+            auto idx = uHash & uMask;
+            if (!(vFlt.vecBits[idx / 64] >> (idx % 64) & 1))
+                return false;
+        }
+        return true;
+    }
+
+    // start an empty filter sized for cNames, the caller adds every name of the directory
+    inline void Build(uint32_t linPar, uint32_t cNames) {
+        Drop(linPar);
+        if (x_map.size() == kCapacity) {
+            x_map.erase(x_lst.back().linPar);
+            x_lst.pop_back();
+        }
+        auto cBits = std::max(cNames * 2, kcMinNames) * kcBitsPerName;
+        auto cWords = (size_t) 1 << (64 - __builtin_clzll(cBits - 1) - 6);
+        x_lst.push_front({linPar, 0, (uint32_t) (cWords * 64 / kcBitsPerName), std::vector<uint64_t>(cWords)});
+        x_map.emplace(linPar, x_lst.begin());
+    }
+
+    inline void Add(uint32_t linPar, std::string_view svName) noexcept {
+        auto it = x_map.find(linPar);
+        if (it == x_map.end())
+            return;
+        auto &vFlt = *it->second;
+        // too many false positives past the sizing, built again on the next miss
+        if (++vFlt.cAdded > vFlt.cMaxNames) {
+            Drop(linPar);
+            return;
+        }
+        auto uMask = (uint32_t) (vFlt.vecBits.size() * 64 - 1);
+        auto [uHash, uStep] = X_Hash(svName);
+        for (uint32_t i = 0; i < kcProbes; ++i, uHash += uStep) {
+            auto idx = uHash & uMask;
+            vFlt.vecBits[idx / 64] |= uint64_t {1} << (idx % 64);
+        }
+    }
+
+    inline void Drop(uint32_t linPar) noexcept {
+        auto it = x_map.find(linPar);
+        if (it == x_map.end())
+            return;
+        auto itLst = it->second;
+        x_map.erase(it);
+        x_lst.erase(itLst);
+    }
+
+private:
+    // double hashing, the step is odd so that the probes differ
+    static inline std::pair<uint32_t, uint32_t> X_Hash(std::string_view svName) noexcept {
+        auto uHash = (uint64_t) std::hash<std::string_view> {}(svName);
+        return {(uint32_t) uHash, (uint32_t) (uHash >> 32) | 1};
+    }
+
+private:
+    struct X_Flt {
+        uint32_t linPar;
+        uint32_t cAdded;
+        uint32_t cMaxNames;
+        std::vector<uint64_t> vecBits;
+    };
+
+private:
+    // most recently used first
+    std::list<X_Flt> x_lst;
+    std::unordered_map<uint32_t, std::list<X_Flt>::iterator> x_map;
+
+};
+
+}}
+
+#endif
@@ -1,31 +1,54 @@
 #include "Common.hpp"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "OpenedDir.hpp"
 #include "Xxfs.hpp"
 
-namespace xxfs {
+namespace xxfs { inline namespace XXFS_CLU_NS {
+
+namespace {
+
+// bit i set if slot i of the fan holds byKey
+inline uint32_t X_FanMatch(const DirFan *pf, uint8_t byKey) noexcept {
+    static_assert(kcfPerFan == 16);
+#ifdef __SSE2__
+    auto vKeys = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pf->abyKey));
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(vKeys, _mm_set1_epi8((char) byKey)));
+#else
+    uint32_t uMask = 0;
+    for (uint32_t i = 0; i < kcfPerFan; ++i)
+        uMask |= (uint32_t) (pf->abyKey[i] == byKey) << i;
+    return uMask;
+#endif
+}
+
+// count of the leading bytes of the fragment of pe matching svName
+inline uint32_t X_Match(const DirEnt *pe, std::string_view svName) noexcept {
+    auto cbMax = (uint32_t) std::min<size_t>(pe->cbKey, svName.size());
+    uint32_t cb = 0;
+    while (cb < cbMax && pe->abyKey[cb] == (uint8_t) svName[cb])
+        ++cb;
+    return cb;
+}
+
+}
 
-std::pair<uint32_t, uint16_t> OpenedDir::Lookup(const char *pszName, DirPolicy vPolicy) {
+std::pair<uint32_t, uint16_t> DirCursor::Lookup(std::string_view svName, DirPolicy vPolicy) {
     if (!pi->ccSize)
-        throw Exception {ENOENT};
-    auto pe = X_GetEnt(0);
-    while (*pszName) {
-        auto byKey = (uint8_t) *pszName;
-        auto lenChild = pe->lenChild;
-        DirEnt *pChild = nullptr;
-        while (lenChild) {
-            pChild = X_GetEnt(lenChild);
-            if (pChild->byKey >= byKey)
-                break;
-            lenChild = pChild->lenNext;
-        }
-        if (!lenChild || pChild->byKey != byKey)
-            throw Exception {ENOENT};
-        pe = pChild;
-        ++pszName;
+        return {0, 0};
+    X_IdxLoad();
+    uint32_t len = 0;
+    while (!svName.empty()) {
+        len = X_Step(len, svName);
+        if (!len)
+            return {0, 0};
     }
+    auto pe = X_GetEnt(len);
     if (!pe->bExist)
-        throw Exception {ENOENT};
+        return {0, 0};
     switch (vPolicy) {
     case DirPolicy::kAny:
         break;
@@ -46,27 +69,39 @@ std::pair<uint32_t, uint16_t> OpenedDir::Lookup(const char *pszName, DirPolicy v
 // begin (denoted by off_t {0}): the first entry with bExist == true
 // end (denoted by ~off_t {0}): empty stack
 off_t OpenedDir::IterSeek(off_t vOff) {
+    if (!x_upIt)
+        x_upIt = std::make_unique<X_Iter>();
+    auto &vIt = *x_upIt;
+    auto vecRecent = std::move(vIt.vecRecent);
+    auto sRecent = std::move(vIt.sRecent);
+    vIt.vecRecent.clear();
+    vIt.sRecent.clear();
     if (!pi->ccSize || vOff == kItEnd) {
-        x_cStkSize = 0;
+        vIt.cStkSize = 0;
         return kItEnd;
     }
     if (vOff == kItBegin) {
-        x_cStkSize = 0;
+        vIt.cStkSize = 0;
         auto lenBegin = X_GetEnt(0)->lenChild;
         if (!lenBegin)
             return kItEnd;
         X_Push(lenBegin);
-        while (x_cStkSize) {
+        while (vIt.cStkSize) {
             if (X_GetEnt(X_Top())->bExist)
                 return (off_t) X_Top();
             X_Next();
         }
-        return x_cStkSize ? (off_t) X_Top() : kItEnd;
+        return vIt.cStkSize ? (off_t) X_Top() : kItEnd;
     }
     auto len = (uint32_t) vOff;
-    if (x_cStkSize) {
+    if (vIt.cStkSize && X_Top() == len)
+        return vOff;
+    for (auto [lenRecent, cbOff] : vecRecent)
+        if (lenRecent == len && X_Locate(len, sRecent.c_str() + cbOff))
+            return vOff;
+    if (vIt.cStkSize) {
         auto lenPrev = X_Top();
-        while (x_cStkSize) {
+        while (vIt.cStkSize) {
             if (X_Top() == len)
                 return (off_t) X_Top();
             X_Next();
@@ -75,7 +110,7 @@ off_t OpenedDir::IterSeek(off_t vOff) {
         if (!lenBegin)
             return kItEnd;
         X_Push(lenBegin);
-        while (x_cStkSize && X_Top() != lenPrev) {
+        while (vIt.cStkSize && X_Top() != lenPrev) {
             if (X_Top() == len)
                 return (off_t) X_Top();
             X_Next();
@@ -87,7 +122,7 @@ off_t OpenedDir::IterSeek(off_t vOff) {
         if (!lenBegin)
             return kItEnd;
         X_Push(lenBegin);
-        while (x_cStkSize) {
+        while (vIt.cStkSize) {
             if (X_Top() == len)
                 return (off_t) X_Top();
             X_Next();
@@ -97,20 +132,23 @@ off_t OpenedDir::IterSeek(off_t vOff) {
 }
 
 const char *OpenedDir::IterGet(FileStat &vStat) noexcept {
-    if (!x_cStkSize)
+    if (!x_upIt || !x_upIt->cStkSize)
         return nullptr;
+    auto &vIt = *x_upIt;
     auto pe = X_GetEnt(X_Top());
     vStat.st_ino = (ino_t) pe->linFile;
     vStat.st_mode = (mode_t) pe->uMode;
-    x_szName[x_cStkSize] = '\0';
-    return x_szName;
+    vIt.szName[vIt.acbStk[vIt.cStkSize - 1]] = '\0';
+    vIt.vecRecent.emplace_back(X_Top(), (uint32_t) vIt.sRecent.size());
+    vIt.sRecent.append(vIt.szName, vIt.acbStk[vIt.cStkSize - 1] + 1);
+    return vIt.szName;
 }
 
 off_t OpenedDir::IterNext() noexcept {
-    if (!x_cStkSize)
+    if (!x_upIt || !x_upIt->cStkSize)
         return kItEnd;
     X_Next();
-    while (x_cStkSize) {
+    while (x_upIt->cStkSize) {
         if (X_GetEnt(X_Top())->bExist)
             return (off_t) X_Top();
         X_Next();
@@ -120,33 +158,55 @@ off_t OpenedDir::IterNext() noexcept {
 
 std::pair<uint32_t, uint16_t> OpenedDir::Insert(const char *pszName, uint32_t lin, uint16_t uMode, DirPolicy vPolicy) {
     X_PrepareRoot();
+    X_IdxLoad();
     auto pe = X_GetEnt(0);
-    auto ceNeed = (uint32_t) strlen(pszName);
-    auto ceFree = kcePerClu * pi->ccSize - pe->linFile;
-    if (ceNeed > ceFree && px->AvailClu() < 4)
+    // a chain holding the rest of the name, a split and a fan at most
+    auto ceNeed = (uint32_t) (strlen(pszName) + kcbDirKey - 1) / kcbDirKey + 4;
+    auto ceFree = kcePerClu * X_CluCount() - pe->linFile;
+    if (ceNeed > ceFree && (px->AvailClu() < 4 || X_CluCount() >= kvcnDirIdx))
         throw Exception {ENOSPC};
+    uint32_t len = 0;
     while (*pszName) {
         auto byKey = (uint8_t) *pszName;
-        auto *pLenChild = &pe->lenChild;
-        DirEnt *pChild = nullptr;
-        while (*pLenChild) {
-            pChild = X_GetEnt(*pLenChild);
-            if (pChild->byKey >= byKey)
-                break;
-            pLenChild = &pChild->lenNext;
-        }
-        if (!*pLenChild || pChild->byKey != byKey) {
-            auto lenNext = *pLenChild;
-            *pLenChild = X_Alloc();
-            pChild = X_GetEnt(*pLenChild);
-            pChild->lenNext = lenNext;
-            pChild->lenChild = 0;
-            pChild->byKey = byKey;
-            pChild->bExist = false;
+        auto lenChild = x_ccIdx ? X_IdxFind(len, byKey) : 0;
+        if (!lenChild) {
+            // find the position in the sorted children
+            auto *pLenChild = &X_GetEnt(len)->lenChild;
+            DirEnt *pChild = nullptr;
+            while (*pLenChild) {
+                pChild = X_GetEnt(*pLenChild);
+                if (pChild->abyKey[0] >= byKey)
+                    break;
+                pLenChild = &pChild->lenNext;
+            }
+            if (!*pLenChild || pChild->abyKey[0] != byKey) {
+                auto lenNext = *pLenChild;
+                lenChild = X_Alloc();
+                *pLenChild = lenChild;
+                pChild = X_GetEnt(lenChild);
+                pChild->linFile = 0;
+                pChild->lenNext = lenNext;
+                pChild->lenChild = 0;
+                pChild->lenFan = 0;
+                pChild->uMode = 0;
+                pChild->cbKey = (uint8_t) strnlen(pszName, kcbDirKey);
+                pChild->bExist = false;
+                memcpy(pChild->abyKey, pszName, pChild->cbKey);
+                X_IdxAdd(len, byKey, lenChild);
+                X_FanAdd(len, byKey, lenChild);
+            }
+            else
+                lenChild = *pLenChild;
         }
-        pe = pChild;
-        ++pszName;
+        // split the fragment where the name departs from it
+        auto pChild = X_GetEnt(lenChild);
+        auto cb = X_Match(pChild, pszName);
+        if (cb < pChild->cbKey)
+            lenChild = X_Split(len, lenChild, cb);
+        len = lenChild;
+        pszName += cb;
     }
+    pe = X_GetEnt(len);
     if (pe->bExist) {
         switch (vPolicy) {
         case DirPolicy::kAny:
@@ -208,24 +268,18 @@ private:
 std::pair<uint32_t, uint16_t> OpenedDir::Remove(const char *pszName, DirPolicy vPolicy) {
     if (!pi->ccSize)
         throw Exception {ENOENT};
-    MappedStack vStk;
-    auto pe = X_GetEnt(0);
-    while (*pszName) {
-        auto byKey = (uint8_t) *pszName;
-        auto *pLenChild = &pe->lenChild;
-        DirEnt *pChild = nullptr;
-        while (*pLenChild) {
-            pChild = X_GetEnt(*pLenChild);
-            if (pChild->byKey >= byKey)
-                break;
-            pLenChild = &pChild->lenNext;
-        }
-        if (!*pLenChild || pChild->byKey != byKey)
+    X_IdxLoad();
+    // parents of the entries on the path
+    uint32_t alenPar[kcbNameBuf];
+    uint32_t cDepth = 0;
+    uint32_t len = 0;
+    for (std::string_view svName {pszName}; !svName.empty(); ) {
+        alenPar[cDepth++] = len;
+        len = X_Step(len, svName);
+        if (!len)
             throw Exception {ENOENT};
-        vStk.Push(x_fpR.Get<DirCluster>(), pLenChild);
-        pe = pChild;
-        ++pszName;
     }
+    auto pe = X_GetEnt(len);
     if (!pe->bExist)
         throw Exception {ENOENT};
     switch (vPolicy) {
@@ -245,33 +299,50 @@ std::pair<uint32_t, uint16_t> OpenedDir::Remove(const char *pszName, DirPolicy v
     auto lin = pe->linFile;
     auto uMode = pe->uMode;
     pe->bExist = false;
-    while (!vStk.IsEmpty()) {
-        auto *pLcn = vStk.Top();
-        auto spc = vStk.Pop();
-        pe = X_GetEnt(*pLcn);
-        if (pe->bExist || pe->lenChild)
+    // free the entries leading to nothing bottom up, then compress the path left
+    while (cDepth) {
+        pe = X_GetEnt(len);
+        if (pe->bExist)
             break;
-        auto lenNext = pe->lenNext;
-        X_Free(*pLcn);
-        *pLcn = lenNext;
+        if (pe->lenChild) {
+            X_Merge(alenPar[cDepth - 1], len);
+            break;
+        }
+        auto lenPar = alenPar[--cDepth];
+        X_Unlink(lenPar, len);
+        len = lenPar;
     }
     return {lin, uMode};
 }
 
-void OpenedDir::Shrink(bool bForce) noexcept {
+void OpenedDir::Shrink(bool bForce) {
     if (!pi->ccSize)
         return;
-    auto peRoot = X_GetEnt(0);
-    auto ceTotal = pi->ccSize * kcePerClu;
+    X_IdxLoad();
+    // the traversal maps far more clusters than the cache holds, keep the root mapped
+    auto spcRoot = x_fpR.Seek<DirCluster>(px, pi, 0);
+    auto peRoot = &spcRoot->aEnts[0];
+    auto ceTotal = X_CluCount() * kcePerClu;
     auto ceUsed = peRoot->linFile;
-    if (!bForce && ceUsed * 2 >= ceTotal)
+    if (!bForce && ceUsed * 4 >= ceTotal)
+        return;
+    // a small directory is below the threshold for good, nothing to gain unless a cluster is dropped
+    if (!bForce && (ceUsed * 2 + kcePerClu - 1) / kcePerClu >= X_CluCount())
         return;
-    auto ccSizeNew = (ceUsed + kcePerClu - 1) / kcePerClu;
+    // fans hold entry numbers, build them again after the move
+    X_FanDrop(0);
+    X_Walk([&](uint32_t, uint32_t len) { X_FanDrop(len); });
+    ceUsed = peRoot->linFile;
+    auto ccSizeNew = std::min((ceUsed * 2 + kcePerClu - 1) / kcePerClu, X_CluCount());
     auto ceNew = ccSizeNew * kcePerClu;
+    // the cluster holding *pLenNext, the free list spans more clusters than the cache holds
+    ShrPtr<DirCluster> spcLink;
     for (auto pLenNext = &peRoot->lenNext; *pLenNext; ) {
         auto pe = X_GetEnt(*pLenNext);
-        if (*pLenNext < ceNew)
+        if (*pLenNext < ceNew) {
+            spcLink = x_fpR.Get<DirCluster>();
             pLenNext = &pe->lenNext;
+        }
         else
             *pLenNext = pe->lenNext;
     }
@@ -296,16 +367,22 @@ void OpenedDir::Shrink(bool bForce) noexcept {
                 vStk.Push(fp.Get<DirCluster>(), &pe->lenChild);
                 continue;
             }
-            auto spc = vStk.Pop();
+            // the cluster of pe, which holds the slot pushed next
+            vStk.Pop();
             while (!vStk.IsEmpty() && !pe->lenNext) {
                 pe = X_MapEnt(fp, *vStk.Top());
-                spc = vStk.Pop();
+                vStk.Pop();
             }
             if (pe->lenNext)
-                vStk.Push(spc, &pe->lenNext);
+                vStk.Push(fp.Get<DirCluster>(), &pe->lenNext);
         }
     }
     pi->cbSize = (uint64_t) kcbCluSize * ccSizeNew;
+    X_FanBuild(0);
+    X_Walk([&](uint32_t, uint32_t len) { X_FanBuild(len); });
+    // entries have moved, the index is rebuilt or dropped (with hysteresis)
+    if (x_ccIdx)
+        X_IdxBuild(ceUsed < kceDirIdxMin / 2 ? 0 : X_IdxSize(ceUsed));
 }
 
 void OpenedDir::X_Next() noexcept {
@@ -315,7 +392,7 @@ void OpenedDir::X_Next() noexcept {
         return;
     }
     X_Pop();
-    while (x_cStkSize && !pe->lenNext) {
+    while (x_upIt->cStkSize && !pe->lenNext) {
         pe = X_GetEnt(X_Top());
         X_Pop();
     }
@@ -323,14 +400,378 @@ void OpenedDir::X_Next() noexcept {
         X_Push(pe->lenNext);
 }
 
+bool OpenedDir::X_Locate(uint32_t len, const char *pszName) noexcept {
+    auto &vIt = *x_upIt;
+    X_IdxLoad();
+    vIt.cStkSize = 0;
+    uint32_t lenCur = 0;
+    for (std::string_view svName {pszName}; !svName.empty(); ) {
+        lenCur = X_Step(lenCur, svName);
+        if (!lenCur) {
+            vIt.cStkSize = 0;
+            return false;
+        }
+        X_Push(lenCur);
+    }
+    if (lenCur != len || !X_GetEnt(len)->bExist) {
+        vIt.cStkSize = 0;
+        return false;
+    }
+    return true;
+}
+
+uint32_t DirCursor::X_Child(uint32_t len, uint8_t byKey) noexcept {
+    if (x_ccIdx)
+        return X_IdxFind(len, byKey);
+    auto pe = X_GetEnt(len);
+    if (pe->lenFan)
+        return X_FanFind(pe->lenFan, byKey);
+    for (auto lenChild = pe->lenChild; lenChild; ) {
+        auto pChild = X_GetEnt(lenChild);
+        if (pChild->abyKey[0] >= byKey)
+            return pChild->abyKey[0] == byKey ? lenChild : 0;
+        lenChild = pChild->lenNext;
+    }
+    return 0;
+}
+
+uint32_t DirCursor::X_Step(uint32_t len, std::string_view &svName) noexcept {
+    len = X_Child(len, (uint8_t) svName[0]);
+    if (!len)
+        return 0;
+    auto pe = X_GetEnt(len);
+    auto cb = X_Match(pe, svName);
+    if (cb < pe->cbKey)
+        return 0;
+    svName.remove_prefix(cb);
+    return len;
+}
+
+uint32_t OpenedDir::X_Split(uint32_t lenParent, uint32_t len, uint32_t cb) {
+    auto lenUp = X_Alloc();
+    DirEnt vUp {};
+    auto pe = X_GetEnt(len);
+    vUp.lenNext = pe->lenNext;
+    vUp.lenChild = len;
+    vUp.cbKey = (uint8_t) cb;
+    memcpy(vUp.abyKey, pe->abyKey, cb);
+    pe->lenNext = 0;
+    pe->cbKey = (uint8_t) (pe->cbKey - cb);
+    memmove(pe->abyKey, pe->abyKey + cb, pe->cbKey);
+    auto byKeyLow = pe->abyKey[0];
+    *X_GetEnt(lenUp) = vUp;
+    // len keeps its number, which is the offset of readdir
+    auto *pLenChild = &X_GetEnt(lenParent)->lenChild;
+    while (*pLenChild != len)
+        pLenChild = &X_GetEnt(*pLenChild)->lenNext;
+    *pLenChild = lenUp;
+    if (x_ccIdx)
+        X_IdxSet(lenParent, vUp.abyKey[0], lenUp);
+    X_IdxAdd(lenUp, byKeyLow, len);
+    if (auto lenFan = X_GetEnt(lenParent)->lenFan)
+        X_FanSet(lenFan, vUp.abyKey[0], lenUp);
+    return lenUp;
+}
+
+void OpenedDir::X_Merge(uint32_t lenParent, uint32_t len) noexcept {
+    auto vUp = *X_GetEnt(len);
+    auto lenChild = vUp.lenChild;
+    auto pChild = X_GetEnt(lenChild);
+    if (pChild->lenNext || vUp.cbKey + pChild->cbKey > kcbDirKey)
+        return;
+    auto byKeyLow = pChild->abyKey[0];
+    memmove(pChild->abyKey + vUp.cbKey, pChild->abyKey, pChild->cbKey);
+    memcpy(pChild->abyKey, vUp.abyKey, vUp.cbKey);
+    pChild->cbKey = (uint8_t) (pChild->cbKey + vUp.cbKey);
+    pChild->lenNext = vUp.lenNext;
+    auto *pLenChild = &X_GetEnt(lenParent)->lenChild;
+    while (*pLenChild != len)
+        pLenChild = &X_GetEnt(*pLenChild)->lenNext;
+    *pLenChild = lenChild;
+    X_FanDrop(len);
+    X_Free(len);
+    if (x_ccIdx) {
+        X_IdxDel(len, byKeyLow);
+        X_IdxSet(lenParent, vUp.abyKey[0], lenChild);
+    }
+    if (auto lenFan = X_GetEnt(lenParent)->lenFan)
+        X_FanSet(lenFan, vUp.abyKey[0], lenChild);
+}
+
+void OpenedDir::X_Unlink(uint32_t lenParent, uint32_t len) noexcept {
+    auto pe = X_GetEnt(len);
+    auto lenNext = pe->lenNext;
+    auto byKey = pe->abyKey[0];
+    auto *pLenChild = &X_GetEnt(lenParent)->lenChild;
+    while (*pLenChild != len)
+        pLenChild = &X_GetEnt(*pLenChild)->lenNext;
+    *pLenChild = lenNext;
+    X_FanDrop(len);
+    X_Free(len);
+    if (x_ccIdx)
+        X_IdxDel(lenParent, byKey);
+    if (auto lenFan = X_GetEnt(lenParent)->lenFan)
+        X_FanSet(lenFan, byKey, 0);
+}
+
+template<class tFn>
+void OpenedDir::X_Walk(tFn &&fnVisit) {
+    // (parent, first child) of each sibling list to visit
+    std::vector<std::pair<uint32_t, uint32_t>> vecStk {{0, X_GetEnt(0)->lenChild}};
+    while (!vecStk.empty()) {
+        auto [lenParent, len] = vecStk.back();
+        vecStk.pop_back();
+        while (len) {
+            auto pe = X_GetEnt(len);
+            auto lenNext = pe->lenNext;
+            if (pe->lenChild)
+                vecStk.emplace_back(len, pe->lenChild);
+            fnVisit(lenParent, len);
+            len = lenNext;
+        }
+    }
+}
+
+uint32_t DirCursor::X_FanFind(uint32_t lenFan, uint8_t byKey) noexcept {
+    while (lenFan) {
+        auto pf = X_GetFan(lenFan);
+        if (auto uMask = X_FanMatch(pf, byKey)) {
+            auto i = (uint32_t) __builtin_ctz(uMask);
+            return X_GetPart(pf->alenPart[i / kcfPerPart])->alen[i % kcfPerPart];
+        }
+        lenFan = pf->lenNext;
+    }
+    return 0;
+}
+
+void OpenedDir::X_FanSet(uint32_t lenFan, uint8_t byKey, uint32_t lenChild) noexcept {
+    while (lenFan) {
+        auto pf = X_GetFan(lenFan);
+        if (auto uMask = X_FanMatch(pf, byKey)) {
+            auto i = (uint32_t) __builtin_ctz(uMask);
+            if (lenChild)
+                X_GetPart(pf->alenPart[i / kcfPerPart])->alen[i % kcfPerPart] = lenChild;
+            else
+                pf->abyKey[i] = 0;
+            return;
+        }
+        lenFan = pf->lenNext;
+    }
+}
+
+bool OpenedDir::X_FanPut(uint32_t lenFan, uint8_t byKey, uint32_t lenChild) noexcept {
+    while (lenFan) {
+        auto pf = X_GetFan(lenFan);
+        if (auto uMask = X_FanMatch(pf, 0)) {
+            auto i = (uint32_t) __builtin_ctz(uMask);
+            pf->abyKey[i] = byKey;
+            X_GetPart(pf->alenPart[i / kcfPerPart])->alen[i % kcfPerPart] = lenChild;
+            return true;
+        }
+        lenFan = pf->lenNext;
+    }
+    return false;
+}
+
+void OpenedDir::X_FanAdd(uint32_t len, uint8_t byKey, uint32_t lenChild) noexcept {
+    auto lenFan = X_GetEnt(len)->lenFan;
+    if (!lenFan) {
+        X_FanBuild(len);
+        return;
+    }
+    if (X_FanPut(lenFan, byKey, lenChild))
+        return;
+    try {
+        auto lenNew = X_FanAlloc();
+        X_GetFan(lenNew)->lenNext = lenFan;
+        X_GetEnt(len)->lenFan = lenNew;
+        X_FanPut(lenNew, byKey, lenChild);
+    }
+    catch (Exception &) {
+        X_FanDrop(len);
+    }
+}
+
+void OpenedDir::X_FanBuild(uint32_t len) noexcept {
+    auto pe = X_GetEnt(len);
+    if (pe->lenFan)
+        return;
+    uint32_t cChild = 0;
+    for (auto lenChild = pe->lenChild; lenChild && cChild < kcFanMin; lenChild = X_GetEnt(lenChild)->lenNext)
+        ++cChild;
+    if (cChild < kcFanMin)
+        return;
+    try {
+        for (auto lenChild = X_GetEnt(len)->lenChild; lenChild; ) {
+            auto pChild = X_GetEnt(lenChild);
+            auto byKey = pChild->abyKey[0];
+            auto lenNext = pChild->lenNext;
+            auto lenFan = X_GetEnt(len)->lenFan;
+            if (!X_FanPut(lenFan, byKey, lenChild)) {
+                auto lenNew = X_FanAlloc();
+                X_GetFan(lenNew)->lenNext = lenFan;
+                X_GetEnt(len)->lenFan = lenNew;
+                X_FanPut(lenNew, byKey, lenChild);
+            }
+            lenChild = lenNext;
+        }
+    }
+    catch (Exception &) {
+        X_FanDrop(len);
+    }
+}
+
+void OpenedDir::X_FanDrop(uint32_t len) noexcept {
+    auto pe = X_GetEnt(len);
+    auto lenFan = pe->lenFan;
+    pe->lenFan = 0;
+    while (lenFan) {
+        auto vf = *X_GetFan(lenFan);
+        for (auto lenPart : vf.alenPart)
+            X_Free(lenPart);
+        X_Free(lenFan);
+        lenFan = vf.lenNext;
+    }
+}
+
+uint32_t OpenedDir::X_FanAlloc() {
+    // the fan and its parts
+    uint32_t alen[1 + kcfPerFan / kcfPerPart] {};
+    try {
+        for (auto &len : alen)
+            len = X_Alloc();
+    }
+    catch (Exception &) {
+        for (auto len : alen)
+            if (len)
+                X_Free(len);
+        throw;
+    }
+    DirFan vf {};
+    std::copy(alen + 1, std::end(alen), vf.alenPart);
+    *X_GetFan(alen[0]) = vf;
+    for (auto lenPart : vf.alenPart)
+        *X_GetPart(lenPart) = {};
+    return alen[0];
+}
+
+void DirCursor::X_IdxLoad() noexcept {
+    // the index may have been rebuilt by another OpenedDir
+    x_fpIdx.Reset();
+    auto byLog = X_GetEnt(0)->abyKey[0];
+    x_ccIdx = byLog ? 1u << (byLog - 1) : 0;
+}
+
+uint32_t DirCursor::X_IdxFind(uint32_t lenParent, uint8_t byKey) noexcept {
+    auto uMask = x_ccIdx * kcdiPerClu - 1;
+    for (auto idx = X_IdxHash(lenParent, byKey) & uMask; ; idx = (idx + 1) & uMask) {
+        auto pdi = X_IdxSlot(idx);
+        if (!pdi->lenChild)
+            return 0;
+        if (pdi->lenParent == lenParent && pdi->byKey == byKey)
+            return pdi->lenChild;
+    }
+}
+
+void OpenedDir::X_IdxAdd(uint32_t lenParent, uint8_t byKey, uint32_t lenChild) {
+    // the new entry is linked already, a rebuild picks it up
+    auto ceUsed = X_GetEnt(0)->linFile;
+    if (!x_ccIdx) {
+        if (ceUsed >= kceDirIdxMin)
+            X_IdxBuild(X_IdxSize(ceUsed));
+    }
+    else if (ceUsed * 2 > x_ccIdx * kcdiPerClu)
+        X_IdxBuild(X_IdxSize(ceUsed));
+    else
+        X_IdxPut(lenParent, byKey, lenChild);
+}
+
+void OpenedDir::X_IdxDel(uint32_t lenParent, uint8_t byKey) noexcept {
+    auto uMask = x_ccIdx * kcdiPerClu - 1;
+    auto idx = X_IdxHash(lenParent, byKey) & uMask;
+    for (;;) {
+        auto pdi = X_IdxSlot(idx);
+        if (!pdi->lenChild)
+            return;
+        if (pdi->lenParent == lenParent && pdi->byKey == byKey)
+            break;
+        idx = (idx + 1) & uMask;
+    }
+    // shift back the following slots which would become unreachable
+    for (auto idxNext = (idx + 1) & uMask; ; idxNext = (idxNext + 1) & uMask) {
+        auto vdi = *X_IdxSlot(idxNext);
+        if (!vdi.lenChild)
+            break;
+        auto idxHome = X_IdxHash(vdi.lenParent, vdi.byKey) & uMask;
+        if (((idxNext - idxHome) & uMask) >= ((idxNext - idx) & uMask)) {
+            *X_IdxSlot(idx) = vdi;
+            idx = idxNext;
+        }
+    }
+    *X_IdxSlot(idx) = {};
+}
+
+void OpenedDir::X_IdxSet(uint32_t lenParent, uint8_t byKey, uint32_t lenChild) noexcept {
+    auto uMask = x_ccIdx * kcdiPerClu - 1;
+    for (auto idx = X_IdxHash(lenParent, byKey) & uMask; ; idx = (idx + 1) & uMask) {
+        auto pdi = X_IdxSlot(idx);
+        if (!pdi->lenChild)
+            return;
+        if (pdi->lenParent == lenParent && pdi->byKey == byKey) {
+            pdi->lenChild = lenChild;
+            return;
+        }
+    }
+}
+
+void OpenedDir::X_IdxBuild(uint32_t ccIdx) {
+    px->Y_FileFreeIdx3(pi, pi->lcnIdx3);
+    x_fpIdx.Reset();
+    x_ccIdx = 0;
+    X_GetEnt(0)->abyKey[0] = 0;
+    // leave the space to the data when it runs low
+    if (!ccIdx || px->AvailClu() < 2 * ccIdx)
+        return;
+    try {
+        FilePtrW fp;
+        for (uint32_t i = 0; i < ccIdx; ++i)
+            fp.Seek<DirIdxCluster>(px, pi, kvcnDirIdx + i);
+    }
+    catch (Exception &) {
+        px->Y_FileFreeIdx3(pi, pi->lcnIdx3);
+        return;
+    }
+    x_ccIdx = ccIdx;
+    X_GetEnt(0)->abyKey[0] = (uint8_t) (__builtin_ctz(ccIdx) + 1);
+    X_Walk([&](uint32_t lenParent, uint32_t len) { X_IdxPut(lenParent, X_GetEnt(len)->abyKey[0], len); });
+}
+
+void OpenedDir::X_IdxPut(uint32_t lenParent, uint8_t byKey, uint32_t lenChild) noexcept {
+    auto uMask = x_ccIdx * kcdiPerClu - 1;
+    auto idx = X_IdxHash(lenParent, byKey) & uMask;
+    while (X_IdxSlot(idx)->lenChild)
+        idx = (idx + 1) & uMask;
+    auto pdi = X_IdxSlot(idx);
+    pdi->lenParent = lenParent;
+    pdi->lenChild = lenChild;
+    pdi->byKey = byKey;
+}
+
+inline DirIdxEnt *DirCursor::X_IdxSlot(uint32_t idx) noexcept {
+    auto spc = x_fpIdx.Seek<DirIdxCluster>(px, pi, kvcnDirIdx + idx / kcdiPerClu);
+    return &spc->aEnts[idx % kcdiPerClu];
+}
+
 void OpenedDir::X_PrepareRoot() {
     if (!pi->ccSize) {
         auto spc = x_fpW.Seek<DirCluster>(px, pi, 0);
-        pi->cbSize = (uint64_t) kcbCluSize * pi->ccSize;
+        pi->cbSize = (uint64_t) kcbCluSize;
         spc->aEnts[0].linFile = 1;
         spc->aEnts[0].lenChild = 0;
+        spc->aEnts[0].lenFan = 0;
         spc->aEnts[0].bExist = false;
-        spc->aEnts[0].byKey = '\0';
+        spc->aEnts[0].cbKey = 0;
+        spc->aEnts[0].abyKey[0] = 0;
         for (uint32_t i = 0; i < kcePerClu; ++i)
             spc->aEnts[i].lenNext = i + 1;
         spc->aEnts[kcePerClu - 1].lenNext = 0;
@@ -340,9 +781,13 @@ void OpenedDir::X_PrepareRoot() {
 uint32_t OpenedDir::X_Alloc() {
     auto peRoot = X_GetEnt(0);
     if (!peRoot->lenNext) {
-        auto len = pi->ccSize * kcePerClu;
-        auto spc = x_fpW.Seek<DirCluster>(px, pi, pi->ccSize);
-        pi->cbSize = (uint64_t) kcbCluSize * pi->ccSize;
+        auto vcn = X_CluCount();
+        // the edge index lives from kvcnDirIdx on
+        if (vcn >= kvcnDirIdx)
+            throw Exception {ENOSPC};
+        auto len = vcn * kcePerClu;
+        auto spc = x_fpW.Seek<DirCluster>(px, pi, vcn);
+        pi->cbSize = (uint64_t) kcbCluSize * (vcn + 1);
         peRoot->lenNext = len;
         for (uint32_t i = 0; i < kcePerClu; ++i)
             spc->aEnts[i].lenNext = len + i + 1;
@@ -363,12 +808,24 @@ void OpenedDir::X_Free(uint32_t len) noexcept {
     --peRoot->linFile;
 }
 
-inline DirEnt *OpenedDir::X_GetEnt(uint32_t len) noexcept {
+inline uint32_t OpenedDir::X_CluCount() const noexcept {
+    return (uint32_t) (pi->cbSize / kcbCluSize);
+}
+
+inline DirEnt *DirCursor::X_GetEnt(uint32_t len) noexcept {
     return X_MapEnt(x_fpR, len);
 }
 
+inline DirFan *DirCursor::X_GetFan(uint32_t len) noexcept {
+    return reinterpret_cast<DirFan *>(X_GetEnt(len));
+}
+
+inline DirFanPart *DirCursor::X_GetPart(uint32_t len) noexcept {
+    return reinterpret_cast<DirFanPart *>(X_GetEnt(len));
+}
+
 template<bool kAlloc>
-inline DirEnt *OpenedDir::X_MapEnt(FilePointer<kAlloc> &fp, uint32_t len) noexcept(!kAlloc) {
+inline DirEnt *DirCursor::X_MapEnt(FilePointer<kAlloc> &fp, uint32_t len) noexcept(!kAlloc) {
     auto ven = len % kcePerClu;
     auto vcn = len / kcePerClu;
     auto spc = fp.template Seek<DirCluster>(px, pi, vcn);
@@ -376,16 +833,20 @@ inline DirEnt *OpenedDir::X_MapEnt(FilePointer<kAlloc> &fp, uint32_t len) noexce
 }
 
 inline uint32_t OpenedDir::X_Top() const noexcept {
-    return x_alenStk[x_cStkSize - 1];
+    return x_upIt->alenStk[x_upIt->cStkSize - 1];
 }
 
 inline void OpenedDir::X_Push(uint32_t len) noexcept {
-    x_szName[x_cStkSize] = (char) X_GetEnt(len)->byKey;
-    x_alenStk[x_cStkSize++] = len;
+    auto &vIt = *x_upIt;
+    auto pe = X_GetEnt(len);
+    auto cbName = vIt.cStkSize ? vIt.acbStk[vIt.cStkSize - 1] : 0;
+    memcpy(vIt.szName + cbName, pe->abyKey, pe->cbKey);
+    vIt.acbStk[vIt.cStkSize] = cbName + pe->cbKey;
+    vIt.alenStk[vIt.cStkSize++] = len;
 }
 
 inline void OpenedDir::X_Pop() noexcept {
-    --x_cStkSize;
+    --x_upIt->cStkSize;
 }
 
-}
+}}
@@ -5,7 +5,7 @@
 
 #include "OpenedFile.hpp"
 
-namespace xxfs {
+namespace xxfs { inline namespace XXFS_CLU_NS {
 
 enum class DirPolicy {
     kAny,
@@ -14,20 +14,71 @@ enum class DirPolicy {
     kNone,
 };
 
-class OpenedDir : public OpenedFile {
+// the read-only walk of a directory, no more than a lookup needs
+// a path walk makes one for each component, the iteration state is left to OpenedDir
+class DirCursor : NoCopyMove {
+public:
+    constexpr DirCursor(Xxfs *px_, Inode *pi_) noexcept : px {px_}, pi {pi_} {}
+
+    // care the case empty dir
+    // requires svName not empty, it need not be terminated
+    // returns inode number, {0, 0} if not exist (a miss is common, so no exception)
+    std::pair<uint32_t, uint16_t> Lookup(std::string_view svName, DirPolicy vPolicy);
+
+protected:
+    // the child of entry len with the first key byte, 0 if not exist
+    uint32_t X_Child(uint32_t len, uint8_t byKey) noexcept;
+    // the child of entry len whose whole fragment prefixes svName, 0 if not exist
+    // requires svName not empty, advances it past the fragment
+    uint32_t X_Step(uint32_t len, std::string_view &svName) noexcept;
+
+    // fans of wide nodes (see DirFan)
+    uint32_t X_FanFind(uint32_t lenFan, uint8_t byKey) noexcept;
+    DirFan *X_GetFan(uint32_t len) noexcept;
+    DirFanPart *X_GetPart(uint32_t len) noexcept;
+
+    // edge index of large directories (see DirIdxEnt)
+    // load the size of the index, required at the beginning of each operation
+    void X_IdxLoad() noexcept;
+    uint32_t X_IdxFind(uint32_t lenParent, uint8_t byKey) noexcept;
+    DirIdxEnt *X_IdxSlot(uint32_t idx) noexcept;
+
+    static constexpr uint32_t X_IdxHash(uint32_t lenParent, uint8_t byKey) noexcept {
+        return (uint32_t) ((((uint64_t) lenParent << 8 | byKey) * 0x9e3779b97f4a7c15) >> 32);
+    }
+
+    DirEnt *X_GetEnt(uint32_t len) noexcept;
+
+    template<bool kAlloc>
+    DirEnt *X_MapEnt(FilePointer<kAlloc> &fp, uint32_t len) noexcept(!kAlloc);
+
+protected:
+    Xxfs *const px;
+    Inode *const pi;
+    FilePtrR x_fpR;
+    FilePtrR x_fpIdx;
+    // count of index clusters, 0 if not indexed
+    uint32_t x_ccIdx = 0;
+
+};
+
+class OpenedDir : public OpenedFile, private DirCursor {
 public:
     constexpr static auto kItBegin = off_t {0};
     constexpr static auto kItEnd = ~off_t {0};
 
 public:
-    constexpr OpenedDir(Xxfs *px, Inode *pi, uint32_t lin) noexcept : OpenedFile(px, pi, lin, false, false, false) {}
+    OpenedDir(Xxfs *px, Inode *pi, uint32_t lin) noexcept :
+        OpenedFile(px, pi, lin, false, false, false), DirCursor(px, pi)
+    {}
 
-    // care the case empty dir
-    // requires pszName not empty
-    // returns inode number
-    std::pair<uint32_t, uint16_t> Lookup(const char *pszName, DirPolicy vPolicy);
+    using OpenedFile::px;
+    using OpenedFile::pi;
+    using DirCursor::Lookup;
 
-    // for readdir
+    // for readdir, offsets are entry numbers
+    // resumes in place at the entry the stack is on or at any entry got since the last seek
+    // otherwise scans from the beginning
     off_t IterSeek(off_t vOff);
     const char *IterGet(FileStat &vStat) noexcept;
     off_t IterNext() noexcept;
@@ -44,15 +95,61 @@ public:
     // returns the inode number
     std::pair<uint32_t, uint16_t> Remove(const char *pszName, DirPolicy vPolicy);
 
-    // re-organize the structure if the count of used entry * 2 is less than the total count
+    // re-organize the structure if the count of used entry * 4 is less than the total count
+    // leaves half of the entries free so that a few inserts do not grow it right away
+    // moves entries, so not while the directory is being iterated (see Xxfs::X_DirShrink)
     // required to call Xxfs::Y_FileShrink after destruction closely
-    void Shrink(bool bForce = false) noexcept;
+    void Shrink(bool bForce = false);
     // does not check constraints, just do it
 
 private:
     // get the next entry in the dir, bExist does not be necessarily true
     // requires stack not empty
     void X_Next() noexcept;
+    // rebuild the stack down to entry len by its name, false if it is no longer there
+    bool X_Locate(uint32_t len, const char *pszName) noexcept;
+
+    // split the fragment of entry len, a child of lenParent, after cb bytes
+    // returns the new entry holding the first part, len keeps the rest
+    uint32_t X_Split(uint32_t lenParent, uint32_t len, uint32_t cb);
+    // fold entry len, a child of lenParent, into its only child if the fragments fit in one
+    void X_Merge(uint32_t lenParent, uint32_t len) noexcept;
+    // unlink entry len from the children of lenParent and free it
+    void X_Unlink(uint32_t lenParent, uint32_t len) noexcept;
+    // visit each entry but the root with its parent, fnVisit must not change the trie
+    template<class tFn>
+    void X_Walk(tFn &&fnVisit);
+
+    // fans of wide nodes (see DirFan), dropped rather than failing when out of space
+    // redirect the slot of byKey to lenChild, free the slot if lenChild is 0
+    void X_FanSet(uint32_t lenFan, uint8_t byKey, uint32_t lenChild) noexcept;
+    // false if there is no free slot
+    bool X_FanPut(uint32_t lenFan, uint8_t byKey, uint32_t lenChild) noexcept;
+    // a new child linked to entry len, builds the fans once it gets wide
+    void X_FanAdd(uint32_t len, uint8_t byKey, uint32_t lenChild) noexcept;
+    void X_FanBuild(uint32_t len) noexcept;
+    void X_FanDrop(uint32_t len) noexcept;
+    // allocate an empty fan with its parts
+    uint32_t X_FanAlloc();
+
+    // edge index of large directories (see DirIdxEnt)
+    // index a new edge, build or grow the index when needed
+    void X_IdxAdd(uint32_t lenParent, uint8_t byKey, uint32_t lenChild);
+    void X_IdxDel(uint32_t lenParent, uint8_t byKey) noexcept;
+    // redirect an indexed edge to another child
+    void X_IdxSet(uint32_t lenParent, uint8_t byKey, uint32_t lenChild) noexcept;
+    // rebuild the index with ccIdx clusters from the trie, drop it if ccIdx is 0
+    // the index is dropped as well when out of space
+    void X_IdxBuild(uint32_t ccIdx);
+    void X_IdxPut(uint32_t lenParent, uint8_t byKey, uint32_t lenChild) noexcept;
+
+    // count of index clusters for ceUsed entries, at most a quarter loaded
+    static constexpr uint32_t X_IdxSize(uint32_t ceUsed) noexcept {
+        uint32_t cc = 1;
+        while ((uint64_t) cc * kcdiPerClu < (uint64_t) ceUsed * 4)
+            cc *= 2;
+        return cc;
+    }
 
     // allocate the root entry and the first cluster if ccSize is zero
     void X_PrepareRoot();
@@ -63,23 +160,36 @@ private:
     uint32_t X_Alloc();
     void X_Free(uint32_t len) noexcept;
 
-    DirEnt *X_GetEnt(uint32_t len) noexcept;
-
-    template<bool kAlloc>
-    DirEnt *X_MapEnt(FilePointer<kAlloc> &fp, uint32_t len) noexcept(!kAlloc);
+    // count of dir clusters, ccSize also counts the index clusters
+    uint32_t X_CluCount() const noexcept;
 
     uint32_t X_Top() const noexcept;
     void X_Push(uint32_t len) noexcept;
     void X_Pop() noexcept;
 
 private:
-    // 0 should never be in the stack
-    uint32_t x_alenStk[kcePerClu] {};
-    char x_szName[kcePerClu] {};
-    uint32_t x_cStkSize = 0;
+    // iteration state, only a handle that is read gets one
+    struct X_Iter {
+        // 0 should never be in the stack
+        uint32_t alenStk[kcbNameBuf];
+        // length of the name up to and including each entry in the stack
+        uint32_t acbStk[kcbNameBuf];
+        char szName[kcbNameBuf];
+        uint32_t cStkSize = 0;
+        // entries got since the last seek with the offsets of their names in sRecent
+        // the kernel resumes at one of them
+        std::vector<std::pair<uint32_t, uint32_t>> vecRecent;
+        std::string sRecent;
+    };
+
+private:
+    // the handle reads through the cursor
+    using DirCursor::x_fpR;
+    // allocated by the first seek
+    std::unique_ptr<X_Iter> x_upIt;
 
 };
 
-}
+}}
 
 #endif
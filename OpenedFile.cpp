@@ -3,7 +3,7 @@
 #include "OpenedFile.hpp"
 #include "Xxfs.hpp"
 
-namespace xxfs {
+namespace xxfs { inline namespace XXFS_CLU_NS {
 
 void OpenedFile::DoRead(void *pBuf, uint64_t cbSize, uint64_t cbOff) {
     auto pBytes = (uint8_t *) pBuf;
@@ -11,9 +11,10 @@ void OpenedFile::DoRead(void *pBuf, uint64_t cbSize, uint64_t cbOff) {
     while (cbRead < cbSize) {
         auto vby = cbOff % kcbCluSize;
         auto vcn = cbOff / kcbCluSize;
-        auto cbToRead = std::min(kcbCluSize - vby, cbSize);
-        auto spc = x_fpR.Seek<ByteCluster>(px, pi, vcn);
-        if (spc)
+        auto cbToRead = std::min(kcbCluSize - vby, cbSize - cbRead);
+        if (auto pc = px->Y_DelayGet(lin, (uint32_t) vcn))
+            memcpy(pBytes, pc->aData + vby, cbToRead);
+        else if (auto spc = x_fpR.Seek<ByteCluster>(px, pi, vcn))
             memcpy(pBytes, spc->aData + vby, cbToRead);
         else
             memset(pBytes, 0, cbToRead);
@@ -30,11 +31,20 @@ uint64_t OpenedFile::DoWrite(const void *pBuf, uint64_t cbSize, uint64_t cbOff)
         while (cbWritten < cbSize) {
             auto vby = cbOff % kcbCluSize;
             auto vcn = cbOff / kcbCluSize;
-            auto cbToWrite = std::min(kcbCluSize - vby, cbSize);
-            auto spc = x_fpW.Seek<ByteCluster>(px, pi, vcn);
-            memcpy(spc->aData + vby, pBytes, cbToWrite);
-            if (bDirect)
-                DoSync();
+            auto cbToWrite = std::min(kcbCluSize - vby, cbSize - cbWritten);
+            // a hole of a regular file is filled in a buffer, allocated when flushed
+            auto pc = px->Y_DelayGet(lin, (uint32_t) vcn);
+            if (!pc && !bDirect && pi->IsReg() && !x_fpR.Seek<ByteCluster>(px, pi, vcn))
+                pc = px->Y_DelayNew(lin, (uint32_t) vcn);
+            if (pc)
+                memcpy(pc->aData + vby, pBytes, cbToWrite);
+            else {
+                x_fpW.Hint(ResvLcn((uint32_t) vcn));
+                auto spc = x_fpW.Seek<ByteCluster>(px, pi, vcn);
+                memcpy(spc->aData + vby, pBytes, cbToWrite);
+                if (bDirect)
+                    DoSync();
+            }
             pBytes += cbToWrite;
             cbOff += cbToWrite;
             cbWritten += cbToWrite;
@@ -47,9 +57,41 @@ uint64_t OpenedFile::DoWrite(const void *pBuf, uint64_t cbSize, uint64_t cbOff)
     return cbWritten;
 }
 
+void OpenedFile::DoPrealloc(uint32_t vcnBegin, uint32_t vcnEnd) {
+    if (ResvLcn(vcnBegin) && vcnEnd - x_vcnResv <= x_ccResv)
+        return;
+    auto ccWindow = x_ccResv ? std::min(2 * x_ccResv, kccPreallocMax) : kccPreallocMin;
+    ccWindow = std::min(ccWindow, std::max(vcnEnd, kccPreallocMin));
+    ccWindow = (uint32_t) std::min<Lcn>(ccWindow, px->AvailClu() / kPreallocFreeDiv);
+    ccWindow = std::max(ccWindow, vcnEnd - vcnBegin);
+    ccWindow = (uint32_t) std::min<uint64_t>(ccWindow, kcbMaxFile / kcbCluSize - vcnBegin);
+    auto bNext = x_lcnResv && vcnBegin == x_vcnResv + x_ccResv;
+    auto lcnNext = x_lcnResv + x_ccResv;
+    DoUnreserve();
+    if (ccWindow < kccPreallocMin)
+        return;
+    // the window follows the previous one, else the cluster before vcnBegin
+    auto lcnHint = bNext ? lcnNext : 0;
+    if (!lcnHint && vcnBegin) {
+        ShrPtr<IndexCluster> spc;
+        auto pLcnPrev = px->Y_FileSlot(pi, vcnBegin - 1, false, spc);
+        if (pLcnPrev && *pLcnPrev && *pLcnPrev != kLcnCmp)
+            lcnHint = *pLcnPrev + 1;
+    }
+    x_lcnResv = px->Y_Reserve(lcnHint ? lcnHint : px->Y_CluGoal(pi), ccWindow);
+    x_vcnResv = vcnBegin;
+    x_ccResv = ccWindow;
+}
+
+void OpenedFile::DoUnreserve() noexcept {
+    if (x_lcnResv)
+        px->Y_Unreserve(x_lcnResv);
+    x_lcnResv = 0;
+}
+
 void OpenedFile::DoSync() noexcept {
     x_fpR.Sync();
     x_fpW.Sync();
 }
 
-}
+}}
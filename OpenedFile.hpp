@@ -5,7 +5,7 @@
 
 #include "FilePointer.hpp"
 
-namespace xxfs {
+namespace xxfs { inline namespace XXFS_CLU_NS {
 
 class Xxfs;
 
@@ -21,6 +21,18 @@ public:
     uint64_t DoWrite(const void *pBuf, uint64_t cbSize, uint64_t cbOff);
     void DoSync() noexcept;
 
+    // speculative preallocation for a file growing sequentially over [vcnBegin, vcnEnd)
+    // sets aside a window of free lcns for the vcns from vcnBegin on, nothing is allocated or mapped
+    // the window steers where the clusters go, it starts small and doubles with each one the handle fills
+    void DoPrealloc(uint32_t vcnBegin, uint32_t vcnEnd);
+    // give the window back, before the handle goes
+    void DoUnreserve() noexcept;
+
+    // the lcn set aside for vcn, 0 if vcn is outside the window
+    inline Lcn ResvLcn(uint32_t vcn) const noexcept {
+        return x_lcnResv && vcn >= x_vcnResv && vcn - x_vcnResv < x_ccResv ? x_lcnResv + (vcn - x_vcnResv) : 0;
+    }
+
 public:
     Xxfs *const px;
     Inode *const pi;
@@ -29,12 +41,16 @@ public:
     const uint32_t bAppend : 1;
     const uint32_t bDirect : 1;
     const uint32_t : 0;
-    
+
 protected:
     FilePtrR x_fpR;
     FilePtrW x_fpW;
+    // the preallocated window, vcns from x_vcnResv on go to lcns from x_lcnResv on
+    uint32_t x_vcnResv = 0;
+    Lcn x_lcnResv = 0;
+    uint32_t x_ccResv = 0;
 };
 
-}
+}}
 
 #endif
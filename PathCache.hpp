@@ -0,0 +1,75 @@
+#ifndef XXFS_PATH_CACHE_HPP_
+#define XXFS_PATH_CACHE_HPP_
+
+#include "Common.hpp"
+
+namespace xxfs { inline namespace XXFS_CLU_NS {
+
+// (parent inode number, name) => (inode number, mode), least recently used dropped first
+// only entries known to exist are kept, removal and rename must drop the names they touch
+class PathCache : NoCopyMove {
+public:
+    constexpr static size_t kCapacity = 4096;
+
+public:
+    // {0, 0} if not cached
+    inline std::pair<uint32_t, uint16_t> Get(uint32_t linPar, std::string_view svName) noexcept {
+        auto it = x_map.find(X_Key(linPar, svName));
+        if (it == x_map.end())
+            return {0, 0};
+        x_lst.splice(x_lst.begin(), x_lst, it->second);
+        return {it->second->lin, it->second->uMode};
+    }
+
+    inline void Put(uint32_t linPar, std::string_view svName, uint32_t lin, uint16_t uMode) {
+        auto svKey = X_Key(linPar, svName);
+        auto it = x_map.find(svKey);
+        if (it != x_map.end()) {
+            it->second->lin = lin;
+            it->second->uMode = uMode;
+            x_lst.splice(x_lst.begin(), x_lst, it->second);
+            return;
+        }
+        if (x_map.size() == kCapacity) {
+            x_map.erase(x_lst.back().sKey);
+            x_lst.pop_back();
+        }
+        x_lst.push_front({std::string(svKey), lin, uMode});
+        x_map.emplace(x_lst.front().sKey, x_lst.begin());
+    }
+
+    inline void Remove(uint32_t linPar, std::string_view svName) noexcept {
+        auto it = x_map.find(X_Key(linPar, svName));
+        if (it == x_map.end())
+            return;
+        auto itLst = it->second;
+        x_map.erase(it);
+        x_lst.erase(itLst);
+    }
+
+private:
+    // valid until the next call
+    inline std::string_view X_Key(uint32_t linPar, std::string_view svName) noexcept {
+        x_sKey.assign(reinterpret_cast<const char *>(&linPar), sizeof(linPar));
+        x_sKey.append(svName);
+        return x_sKey;
+    }
+
+private:
+    struct X_Ent {
+        std::string sKey;
+        uint32_t lin;
+        uint16_t uMode;
+    };
+
+private:
+    // most recently used first, keys of x_map refer to the strings here
+    std::list<X_Ent> x_lst;
+    std::unordered_map<std::string_view, std::list<X_Ent>::iterator> x_map;
+    std::string x_sKey;
+
+};
+
+}}
+
+#endif
@@ -3,7 +3,7 @@
 
 #include "Common.hpp"
 
-namespace xxfs {
+namespace xxfs { inline namespace XXFS_CLU_NS {
     
 struct UnmapDeleter {
     inline void operator ()(void *pObj) const noexcept {
@@ -12,7 +12,7 @@ struct UnmapDeleter {
 };
 
 template<class tObj>
-inline ShrPtr<tObj> ShrMap(int fd, uint32_t lcn) {
+inline ShrPtr<tObj> ShrMap(int fd, Lcn lcn) {
     auto pVoid = mmap(
         nullptr, kcbCluSize, PROT_READ | PROT_WRITE,
         MAP_SHARED, fd, (off_t) kcbCluSize * lcn
@@ -22,12 +22,74 @@ inline ShrPtr<tObj> ShrMap(int fd, uint32_t lcn) {
     return ShrPtr<tObj>(reinterpret_cast<tObj *>(pVoid), UnmapDeleter {});
 }
 
+// a run of clusters mapped at once
+struct UnmapRunDeleter {
+    inline void operator ()(void *pObj) const noexcept {
+        munmap(pObj, cbSize);
+    }
+
+    size_t cbSize;
+};
+
+template<class tObj>
+using RunPtr = std::unique_ptr<tObj[], UnmapRunDeleter>;
+
+constexpr size_t kcbHugePage = size_t {2} << 20;
+
+// the address is congruent to the file offset modulo the huge page size
+// so that huge folios of the page cache can be mapped by single entries
+// MADV_HUGEPAGE is only advice, it is ignored where the page cache of the file has no huge folios
+inline void *HugeMap(int fd, off_t cbOff, size_t cbSize) noexcept {
+    auto cbRsv = cbSize + kcbHugePage;
+    auto pRsv = mmap(nullptr, cbRsv, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pRsv == MAP_FAILED)
+        return MAP_FAILED;
+    auto uRsv = reinterpret_cast<uintptr_t>(pRsv);
+    auto uAt = uRsv + (((uintptr_t) cbOff - uRsv) & (kcbHugePage - 1));
+    auto pVoid = mmap(
+        reinterpret_cast<void *>(uAt), cbSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_FIXED, fd, cbOff
+    );
+    if (pVoid == MAP_FAILED) {
+        munmap(pRsv, cbRsv);
+        return MAP_FAILED;
+    }
+    if (uAt != uRsv)
+        munmap(pRsv, uAt - uRsv);
+    munmap(reinterpret_cast<void *>(uAt + cbSize), uRsv + cbRsv - uAt - cbSize);
+    madvise(pVoid, cbSize, MADV_HUGEPAGE);
+    return pVoid;
+}
+
+template<class tObj>
+inline RunPtr<tObj> RunMap(int fd, Lcn lcn, Lcn cc, bool bHuge = false) {
+    auto cbSize = (size_t) kcbCluSize * cc;
+    auto cbOff = (off_t) kcbCluSize * lcn;
+    auto pVoid = bHuge ?
+        HugeMap(fd, cbOff, cbSize) :
+        mmap(nullptr, cbSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, cbOff);
+    if (pVoid == MAP_FAILED)
+        RAISE("Failed to invoke mmap()", errno);
+    return {reinterpret_cast<tObj *>(pVoid), UnmapRunDeleter {cbSize}};
+}
+
 template<class tObj>
 inline void ShrSync(const ShrPtr<tObj> &spc) noexcept {
     if (spc)
         msync(spc.get(), kcbCluSize, MS_SYNC);
 }
 
+// msync cc clusters from lcn through a mapping of their own, best effort
+// the dirty pages are in the page cache of fd, whichever mapping wrote them
+inline void RunSync(int fd, Lcn lcn, uint32_t cc) noexcept {
+    auto cbSize = (size_t) kcbCluSize * cc;
+    auto pVoid = mmap(nullptr, cbSize, PROT_READ, MAP_SHARED, fd, (off_t) kcbCluSize * lcn);
+    if (pVoid == MAP_FAILED)
+        return;
+    msync(pVoid, cbSize, MS_SYNC);
+    munmap(pVoid, cbSize);
+}
+
 class RaiiFile {
 public:
     constexpr RaiiFile() noexcept = default;
@@ -79,6 +141,6 @@ constexpr std::unique_ptr<tObj, tDel> WrapPtr(tObj *pObj, tDel fnDel) {
 
 #define RAII_GUARD(ptr_, del_) auto CONCAT(up_, __COUNTER__) = ::xxfs::WrapPtr(ptr_, del_)
 
-}
+}}
 
 #endif
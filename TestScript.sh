@@ -470,6 +470,227 @@ function test6 ()
     return 0
 }
 
+function remount ()
+{
+    # remount with the options given
+    cd "$old_pwd"
+    fusermount -u "$MOUNT_POINT"
+    if [ $? -ne 0 ]; then
+        echo "    umount failed"
+        return 1
+    fi
+    eval " $FUSE_MAIN $* $VOLUME_FILE $MOUNT_POINT "
+    if [ $? -ne 0 ]; then
+        echo "    mount failed"
+        return 1
+    fi
+    cd "$MOUNT_POINT"
+    return 0
+}
+
+function test7 ()
+{
+    echo "$DIVIDING_LINE"
+    echo "test 7: shared copy and overwrite of one copy"
+    local old_pwd="$PWD"
+    cd "$MOUNT_POINT"
+
+    printf "    create a file of 8MB ... "
+    dd if=/dev/urandom of=/tmp/fs_orig bs=1M count=8 2>/dev/null
+    cp /tmp/fs_orig "orig"
+    orig_hash=($(md5sum /tmp/fs_orig))
+    echo "done"
+
+    printf "    copy it with copy_file_range ... "
+    declare -i used1=$(df --output=used . | tail -1)
+    cp "orig" "copy"
+    if [ $? -ne 0 ]; then
+        echo "failed"
+        return 1
+    fi
+    declare -i used2=$(df --output=used . | tail -1)
+    if (( $used2 - $used1 < 4096 )); then
+        echo "clusters are shared"
+    else
+        echo "clusters are not shared, cp may not use copy_file_range"
+    fi
+
+    printf "    overwrite the middle of the copy ... "
+    dd if=/dev/zero of="copy" bs=1M seek=2 count=2 conv=notrunc 2>/dev/null
+    dd if=/dev/zero of=/tmp/fs_orig bs=1M seek=2 count=2 conv=notrunc 2>/dev/null
+    copy_hash=($(md5sum /tmp/fs_orig))
+    echo "done"
+
+    for i in 1 2
+    do
+        printf "    check hash values ... "
+        file_hash=($(md5sum "orig"))
+        if ! [ "$file_hash" == "$orig_hash" ]; then
+            echo "the original changed"
+            return 1
+        fi
+        file_hash=($(md5sum "copy"))
+        if ! [ "$file_hash" == "$copy_hash" ]; then
+            echo "the copy mismatches"
+            return 1
+        fi
+        echo "done"
+        if [ $i -eq 1 ]; then
+            printf "    remount filesystem ... "
+            remount || return 1
+            echo "done"
+        fi
+    done
+
+    rm "orig" "copy" /tmp/fs_orig
+    cd "$old_pwd"
+    return 0
+}
+
+function test8 ()
+{
+    echo "$DIVIDING_LINE"
+    echo "test 8: compressed and deduplicated data round trip"
+    local old_pwd="$PWD"
+    cd "$MOUNT_POINT"
+
+    for opt in -c -d
+    do
+        printf "    mount filesystem with $opt and write files ... "
+        remount $opt || return 1
+        for ((i = 0; i < 64; ++i)); do echo "$i:$TEST_STRING"; done > /tmp/fs_text
+        for ((i = 0; i < 10; ++i)); do cat /tmp/fs_text; done > /tmp/fs_text1
+        dd if=/dev/urandom of=/tmp/fs_rand bs=1M count=2 2>/dev/null
+        cp /tmp/fs_text1 "text1"
+        cp /tmp/fs_text1 "text2"
+        cp /tmp/fs_rand "rand"
+        echo "done"
+        for m in "$opt" ""
+        do
+            printf "    check files mounted with \"$m\" ... "
+            if ! (cmp -s "text1" /tmp/fs_text1 && cmp -s "text2" /tmp/fs_text1 && cmp -s "rand" /tmp/fs_rand); then
+                echo "mismatch"
+                return 1
+            fi
+            echo "done"
+            remount || return 1
+        done
+        rm "text1" "text2" "rand" /tmp/fs_text /tmp/fs_text1 /tmp/fs_rand
+    done
+
+    cd "$old_pwd"
+    return 0
+}
+
+function test9 ()
+{
+    echo "$DIVIDING_LINE"
+    echo "test 9: running out of space with buffered writes"
+    local old_pwd="$PWD"
+    cd "$MOUNT_POINT"
+
+    dd if=/dev/urandom of=/tmp/fs_chunk bs=1M count=1 2>/dev/null
+    declare -i avail=$(df --output=avail . | tail -1)
+    printf "    append 1MB chunks until the space runs out ... "
+    declare -i n=0
+    while (( $n < 65536 )) && cat /tmp/fs_chunk >> "fill" 2>/dev/null
+    do
+        let n=n+1
+    done
+    if (( $n >= 65536 )); then
+        echo "the space never ran out"
+        return 1
+    fi
+    echo "$n chunks"
+
+    printf "    check the chunks written ... "
+    for ((i = 0; i < n; ++i))
+    do
+        if ! dd if="fill" bs=1M skip=$i count=1 2>/dev/null | cmp -s - /tmp/fs_chunk; then
+            echo "chunk $i mismatches"
+            return 1
+        fi
+    done
+    echo "done"
+
+    printf "    delete it and check the free space ... "
+    rm "fill" /tmp/fs_chunk
+    declare -i avail2=$(df --output=avail . | tail -1)
+    if (( $avail2 + 1024 < $avail )); then
+        echo "$(( $avail - $avail2 ))KB lost"
+        return 1
+    fi
+    echo "done"
+
+    cd "$old_pwd"
+    return 0
+}
+
+function test10 ()
+{
+    echo "$DIVIDING_LINE"
+    echo "test 10: unlink while reading a large directory"
+    local old_pwd="$PWD"
+    cd "$MOUNT_POINT"
+
+    printf "    create 4096 files ... "
+    mkdir "large"
+    cd "large"
+    for ((i = 0; i < 4096; ++i)); do : > "file_$i"; done
+    cd ..
+    echo "done"
+
+    printf "    delete every even file while listing ... "
+    find "large" -name "*[02468]" -delete
+    declare -i cnt=$(ls "large" | wc -l)
+    if [ $cnt -ne 2048 ]; then
+        echo "$cnt files left, expected 2048"
+        return 1
+    fi
+    echo "done"
+
+    printf "    rm -rf the rest ... "
+    rm -rf "large"
+    if [[ ($? -ne 0) || (-e "large") ]]; then
+        echo "failed"
+        return 1
+    fi
+    echo "done"
+
+    cd "$old_pwd"
+    return 0
+}
+
+function test11 ()
+{
+    echo "$DIVIDING_LINE"
+    echo "test 11: refuse an image of an unknown version"
+    local mkfs_main="$(dirname $FUSE_MAIN)/mkxxfs"
+
+    printf "    format an image and set its version to 0xffffffff ... "
+    rm -f /tmp/fs_volume
+    truncate -s 64M /tmp/fs_volume
+    $mkfs_main /tmp/fs_volume > /dev/null
+    if [ $? -ne 0 ]; then
+        echo "failed"
+        return 1
+    fi
+    # MetaCluster::uVersion
+    printf '\xff\xff\xff\xff' | dd of=/tmp/fs_volume bs=1 seek=184 conv=notrunc 2>/dev/null
+    echo "done"
+
+    printf "    mount it ... "
+    eval " $FUSE_MAIN /tmp/fs_volume $MOUNT_POINT " 2>/dev/null
+    if [ $? -eq 0 ]; then
+        fusermount -u "$MOUNT_POINT"
+        echo "mounted"
+        return 1
+    fi
+    echo "refused"
+    rm /tmp/fs_volume
+    return 0
+}
+
 function testWrite ()
 {
     local temp_spd
@@ -573,6 +794,51 @@ function doTest()
         echo "test 6 passed"
     fi
 
+    test7
+    if [ $? -eq 1 ]; then
+        echo "test 7 failed"
+        echo "see the log above for detailed information"
+        return 1
+    else
+        echo "test 7 passed"
+    fi
+
+    test8
+    if [ $? -eq 1 ]; then
+        echo "test 8 failed"
+        echo "see the log above for detailed information"
+        return 1
+    else
+        echo "test 8 passed"
+    fi
+
+    test9
+    if [ $? -eq 1 ]; then
+        echo "test 9 failed"
+        echo "see the log above for detailed information"
+        return 1
+    else
+        echo "test 9 passed"
+    fi
+
+    test10
+    if [ $? -eq 1 ]; then
+        echo "test 10 failed"
+        echo "see the log above for detailed information"
+        return 1
+    else
+        echo "test 10 passed"
+    fi
+
+    test11
+    if [ $? -eq 1 ]; then
+        echo "test 11 failed"
+        echo "see the log above for detailed information"
+        return 1
+    else
+        echo "test 11 passed"
+    fi
+
     testWrite
     return 0
 }
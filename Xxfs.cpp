@@ -1,29 +1,65 @@
 #include "Common.hpp"
 
+#include "Compressor.hpp"
 #include "Raii.hpp"
 
 #include "Xxfs.hpp"
 
-namespace xxfs {
+namespace xxfs { inline namespace XXFS_CLU_NS {
 
-Xxfs::Xxfs(RaiiFile &&vRf, ShrPtr<MetaCluster> &&spcMeta) :
+Xxfs::Xxfs(RaiiFile &&vRf, ShrPtr<MetaCluster> &&spcMeta, bool bCompress, bool bDedup, bool bHuge) :
     x_vRf(std::move(vRf)),
     x_spcMeta(std::move(spcMeta)),
     x_vCluCache(x_vRf.Get()),
-    x_vInoCluCache(x_vRf.Get()),
-    x_vCluAlloc(x_vRf.Get(), x_spcMeta->lcnCluBmp, x_spcMeta->ccCluBmp),
-    x_vInoAlloc(x_vRf.Get(), x_spcMeta->lcnInoBmp, x_spcMeta->ccInoBmp)
+    x_upInos(RunMap<Inode>(x_vRf.Get(), x_spcMeta->lcnIno, x_spcMeta->ccIno, bHuge)),
+    x_vCluAlloc(x_vRf.Get(), x_spcMeta->lcnCluBmp, x_spcMeta->ccCluBmp, x_spcMeta->ccCluBmp, bHuge),
+    x_vInoAlloc(x_vRf.Get(), x_spcMeta->lcnInoBmp, x_spcMeta->ccInoBmp, x_spcMeta->ccCluBmp, bHuge),
+    x_bCompress(bCompress),
+    x_bDedup(bDedup)
 {}
 
-uint32_t Xxfs::LinAt(const char *pszPath) {
-    auto lin = LinPar(pszPath);
-    if (*pszPath) {
+void Xxfs::Upgrade() {
+    if (x_spcMeta->uVersion >= kVersion)
+        return;
+    if (!x_spcMeta->uVersion)
+        X_UpgradeDirs();
+    // versions 1 and 2: the cluster size and the lcn width go into the padding, which was zero
+    // older images always have 32-bit lcns, ProbeBuild hands them to a 32-bit build
+    x_spcMeta->uCluShift = kCluShift;
+    x_spcMeta->uLcnBits = kLcnBits;
+    x_spcMeta->uVersion = kVersion;
+}
+
+void Xxfs::X_UpgradeDirs() {
+    // version 0: every directory is rebuilt as a radix trie
+    // the directories are listed first so that the space check covers all of them
+    std::vector<uint32_t> vecDirs {0};
+    uint64_t ccDirs = 0;
+    for (size_t i = 0; i < vecDirs.size(); ++i) {
+        auto pi = X_GetInode(vecDirs[i]);
+        ccDirs += pi->ccSize;
+        for (auto &[sName, lin, uMode] : X_ListV0(pi))
+            if (S_ISDIR(uMode))
+                vecDirs.emplace_back(lin);
+    }
+    // a radix node is twice as large as a byte node but never outnumbers them, the edge index comes on top
+    if (AvailClu() < 4 * ccDirs)
+        throw Exception {ENOSPC};
+    for (auto lin : vecDirs) {
         auto pi = X_GetInode(lin);
-        {
-            OpenedDir vDir(this, pi, lin);
-            lin = vDir.Lookup(pszPath, DirPolicy::kAny).first;
-        }
+        auto vecEnts = X_ListV0(pi);
+        pi->cbSize = 0;
+        Y_FileShrink(pi);
+        OpenedDir vDir(this, pi, lin);
+        for (auto &[sName, linFile, uMode] : vecEnts)
+            vDir.Insert(sName.c_str(), linFile, uMode, DirPolicy::kNone);
     }
+}
+
+uint32_t Xxfs::LinAt(const char *pszPath) {
+    auto lin = LinPar(pszPath);
+    if (*pszPath && !(lin = X_Lookup(lin, pszPath, DirPolicy::kAny).first))
+        throw Exception {ENOENT};
     return lin;
 }
 
@@ -31,51 +67,72 @@ uint32_t Xxfs::LinPar(const char *&pszPath) {
     uint32_t lin = 0;
     auto pszDelim = strchr(++pszPath, '/');
     while (pszDelim) {
-        auto pi = X_GetInode(lin);
-        {
-            OpenedDir vDir(this, pi, lin);
-            lin = vDir.Lookup(std::string(pszPath, pszDelim).c_str(), DirPolicy::kDir).first;
-        }
+        lin = X_Lookup(lin, std::string_view(pszPath, (size_t) (pszDelim - pszPath)), DirPolicy::kDir).first;
+        if (!lin)
+            throw Exception {ENOENT};
         pszPath = pszDelim;
         pszDelim = strchr(++pszPath, '/');
     }
     return lin;
 }
 
-/*uint32_t Xxfs::Lookup(FileStat &vStat, uint32_t linPar, const char *pszName) {
-    if (strlen(pszName) >= kcePerClu)
+uint32_t Xxfs::Lookup(FileStat &vStat, uint32_t linPar, const char *pszName) {
+    if (strlen(pszName) >= kcbNameBuf)
         throw Exception {ENAMETOOLONG};
     auto piPar = X_GetInode(linPar);
-    OpenedDir vParDir(this, piPar);
-    auto [lin, uMode] = vParDir.Lookup(pszName, DirPolicy::kAny);
-    (void) uMode;
-    auto pi = X_GetInode(lin);
-    FillStat(vStat, lin, pi);
+    if (!piPar->IsDir())
+        throw Exception {ENOTDIR};
+    auto lin = X_Lookup(linPar, pszName, DirPolicy::kAny).first;
+    if (!lin)
+        return 0;
+    FillStat(vStat, lin, X_GetInode(lin));
+    x_vInoCache.IncLookup(lin);
     return lin;
 }
 
-void Xxfs::Forget(uint32_t lin, uint64_t cLookup) {
-    x_vInoCache.DecLookup(lin, cLookup);
-}*/
+void Xxfs::Forget(uint32_t lin, uint64_t cLookup) noexcept {
+    if (!x_vInoCache.DecLookup(lin, cLookup))
+        return;
+    auto pi = X_GetInode(lin);
+    if (!pi->cLink)
+        Y_FreeIno(lin, pi);
+}
+
+void Xxfs::ForgetAll() {
+    for (auto lin : x_vInoCache.Looked())
+        Forget(lin, std::numeric_limits<uint64_t>::max());
+    // a last try for data whose flush ran out of space, what still does not fit goes with the mount
+    Y_DelayFlushAll();
+}
 
 void Xxfs::GetAttr(FileStat &vStat, uint32_t lin) {
     auto pi = X_GetInode(lin);
     FillStat(vStat, lin, pi);
 }
 
-/*void Xxfs::SetAttr(FileStat &vStat, FileStat *pStat, uint32_t lin, int nFlags, fuse_file_info *pInfo) {
+void Xxfs::SetAttr(FileStat &vStat, uint32_t lin, const FileStat &vNew, int nFlags, OpenedFile *pFile) {
     auto pi = X_GetInode(lin);
+    if (nFlags & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+        throw Exception {ENOSYS};
+    // times are not kept, setting them succeeds and changes nothing
+    // the writeback cache sends mtime and ctime on close and fsync, failing them would fail those
     if (nFlags & FUSE_SET_ATTR_SIZE) {
-        if (pi->IsDir())
-            throw Exception {EISDIR};
-        if ((size_t) pStat->st_size >= kcbMaxSize)
-            throw Exception {EINVAL};
-        pi->cbSize = (uint64_t) pStat->st_size;
-        if (!pInfo)
-            Y_FileShrink(pi);
+        if (!pFile)
+            Truncate(lin, vNew.st_size);
+        else {
+            if (pi->IsDir())
+                throw Exception {EISDIR};
+            if ((uint64_t) vNew.st_size > kcbMaxFile)
+                throw Exception {EINVAL};
+            // the clusters are freed on release
+            if ((uint64_t) vNew.st_size < pi->cbSize)
+                X_ZeroTail(lin, pi, (uint64_t) vNew.st_size);
+            pi->cbSize = (uint64_t) vNew.st_size;
+            Y_DelayDrop(lin, (uint32_t) ((pi->cbSize + kcbCluSize - 1) / kcbCluSize));
+        }
     }
     FillStat(vStat, lin, pi);
-}*/
+}
 
 void Xxfs::ReadLink(uint32_t lin, char *pBuf, size_t cbSize) {
     auto pi = X_GetInode(lin);
@@ -83,18 +140,19 @@ void Xxfs::ReadLink(uint32_t lin, char *pBuf, size_t cbSize) {
     strncpy(pBuf, lcn ? Y_Map<char>(lcn).get() : "", cbSize);
 }
 
-void Xxfs::MkDir(uint32_t linPar, const char *pszName) {
-    if (strlen(pszName) >= kcePerClu)
+uint32_t Xxfs::MkDir(FileStat &vStat, uint32_t linPar, const char *pszName) {
+    if (strlen(pszName) >= kcbNameBuf)
         throw Exception {ENAMETOOLONG};
     auto piPar = X_GetInode(linPar);
     if (!piPar->IsDir())
         throw Exception {ENOTDIR};
-    auto lin = Y_AllocIno();
+    auto lin = Y_AllocIno(linPar, true);
     auto pi = X_GetInode(lin);
     memset(pi, 0, sizeof(Inode));
     pi->uMode = S_IFDIR | 0777;
     pi->cLink = 1;
     try {
+        x_vNameFilter.Add(linPar, pszName);
         OpenedDir vDir(this, piPar, linPar);
         vDir.Insert(pszName, lin, pi->uMode, DirPolicy::kNone);
     }
@@ -102,33 +160,40 @@ void Xxfs::MkDir(uint32_t linPar, const char *pszName) {
         Y_UnlinkIno(lin, pi);
         throw;
     }
+    FillStat(vStat, lin, X_GetInode(lin));
+    x_vInoCache.IncLookup(lin);
+    return lin;
 }
 void Xxfs::Unlink(uint32_t linPar, const char *pszName) {
-    if (strlen(pszName) >= kcePerClu)
+    if (strlen(pszName) >= kcbNameBuf)
         throw Exception {ENAMETOOLONG};
     auto piPar = X_GetInode(linPar);
     if (!piPar->IsDir())
         throw Exception {ENOTDIR};
+    x_vPathCache.Remove(linPar, pszName);
     {
         OpenedDir vDir(this, piPar, linPar);
         auto [lin, uMode] = vDir.Remove(pszName, DirPolicy::kNotDir);
         (void) uMode;
         Y_UnlinkIno(lin, X_GetInode(lin));
-        vDir.Shrink();
+        X_DirShrink(vDir);
     }
     Y_FileShrink(piPar);
 }
 
 void Xxfs::RmDir(uint32_t linPar, const char *pszName) {
-    if (strlen(pszName) >= kcePerClu)
+    if (strlen(pszName) >= kcbNameBuf)
         throw Exception {ENAMETOOLONG};
     auto piPar = X_GetInode(linPar);
     if (!piPar->IsDir())
         throw Exception {ENOTDIR};
+    x_vPathCache.Remove(linPar, pszName);
     {
         OpenedDir vDir(this, piPar, linPar);
         auto [lin, uMode] = vDir.Lookup(pszName, DirPolicy::kDir);
         (void) uMode;
+        if (!lin)
+            throw Exception {ENOENT};
         auto pi = X_GetInode(lin);
         if (pi->ccSize) {
             auto spc = Y_Map<DirCluster>(pi->lcnIdx0[0]);
@@ -136,14 +201,15 @@ void Xxfs::RmDir(uint32_t linPar, const char *pszName) {
                 throw Exception {ENOTEMPTY};
         }
         vDir.Remove(pszName, DirPolicy::kDir);
+        x_vNameFilter.Drop(lin);
         Y_UnlinkIno(lin, pi);
-        vDir.Shrink();
+        X_DirShrink(vDir);
     }
     Y_FileShrink(piPar);
 }
 
-void Xxfs::SymLink(const char *pszLink, uint32_t linPar, const char *pszName) {
-    if (strlen(pszName) >= kcePerClu)
+uint32_t Xxfs::SymLink(FileStat &vStat, const char *pszLink, uint32_t linPar, const char *pszName) {
+    if (strlen(pszName) >= kcbNameBuf)
         throw Exception {ENAMETOOLONG};
     auto cbLength = strlen(pszLink);
     if (cbLength >= kcbCluSize)
@@ -151,7 +217,7 @@ void Xxfs::SymLink(const char *pszLink, uint32_t linPar, const char *pszName) {
     auto piPar = X_GetInode(linPar);
     if (!piPar->IsDir())
         throw Exception {ENOTDIR};
-    auto lin = Y_AllocIno();
+    auto lin = Y_AllocIno(linPar, false);
     auto pi = X_GetInode(lin);
     memset(pi, 0, sizeof(Inode));
     pi->uMode = S_IFLNK | 0777;
@@ -161,6 +227,7 @@ void Xxfs::SymLink(const char *pszLink, uint32_t linPar, const char *pszName) {
             OpenedFile vFile(this, pi, lin, true, false, false);
             vFile.DoWrite(pszLink, (uint64_t) cbLength + 1, 0);
         }
+        x_vNameFilter.Add(linPar, pszName);
         OpenedDir vDir(this, piPar, linPar);
         vDir.Insert(pszName, lin, pi->uMode, DirPolicy::kNone);
     }
@@ -168,6 +235,9 @@ void Xxfs::SymLink(const char *pszLink, uint32_t linPar, const char *pszName) {
         Y_UnlinkIno(lin, pi);
         throw;
     }
+    FillStat(vStat, lin, X_GetInode(lin));
+    x_vInoCache.IncLookup(lin);
+    return lin;
 }
 
 void Xxfs::Rename(
@@ -175,9 +245,9 @@ void Xxfs::Rename(
     uint32_t linNewPar, const char *pszNewName,
     unsigned uFlags
 ) {
-    if (strlen(pszName) >= kcePerClu)
+    if (strlen(pszName) >= kcbNameBuf)
         throw Exception {ENAMETOOLONG};
-    if (strlen(pszNewName) >= kcePerClu)
+    if (strlen(pszNewName) >= kcbNameBuf)
         throw Exception {ENAMETOOLONG};
     auto piPar = X_GetInode(linPar);
     if (!piPar->IsDir())
@@ -185,12 +255,20 @@ void Xxfs::Rename(
     auto piNewPar = X_GetInode(linNewPar);
     if (!piNewPar->IsDir())
         throw Exception {ENOTDIR};
+    x_vPathCache.Remove(linPar, pszName);
+    x_vPathCache.Remove(linNewPar, pszNewName);
+    x_vNameFilter.Add(linNewPar, pszNewName);
+    // the exchange puts a name back into the old parent
+    if (uFlags == RENAME_EXCHANGE)
+        x_vNameFilter.Add(linPar, pszName);
     {
         OpenedDir vDir(this, piPar, linPar);
         OpenedDir vNewDir(this, piNewPar, linNewPar);
         switch (uFlags) {
         case 0: {
             auto [lin, uMode] = vDir.Lookup(pszName, DirPolicy::kAny);
+            if (!lin)
+                throw Exception {ENOENT};
             auto [linOth, uOthMode] = vNewDir.Insert(pszNewName, lin, uMode, DirPolicy::kNotDir);
             (void) uOthMode;
             if (linOth) {
@@ -202,15 +280,19 @@ void Xxfs::Rename(
         }
         case RENAME_NOREPLACE: {
             auto [lin, uMode] = vDir.Lookup(pszName, DirPolicy::kAny);
+            if (!lin)
+                throw Exception {ENOENT};
             vNewDir.Insert(pszNewName, lin, uMode, DirPolicy::kNone);
             vDir.Remove(pszName, DirPolicy::kAny);
             break;
         }
         case RENAME_EXCHANGE: {
             auto [lin, uMode] = vDir.Lookup(pszName, DirPolicy::kAny);
+            if (!lin)
+                throw Exception {ENOENT};
             auto [linOth, uOthMode] = vNewDir.Insert(pszNewName, lin, uMode, DirPolicy::kAny);
             if (linOth)
-                vDir.Insert(pszName, lin, uOthMode, DirPolicy::kAny);
+                vDir.Insert(pszName, linOth, uOthMode, DirPolicy::kAny);
             else
                 vDir.Remove(pszName, DirPolicy::kAny);
             break;
@@ -218,15 +300,15 @@ void Xxfs::Rename(
         default:
             throw Exception {EINVAL};
         }
-        vDir.Shrink();
-        vNewDir.Shrink();
+        X_DirShrink(vDir);
+        X_DirShrink(vNewDir);
     }
     Y_FileShrink(piPar);
     Y_FileShrink(piNewPar);
 }
 
-void Xxfs::Link(uint32_t lin, uint32_t linNewPar, const char *pszNewName) {
-    if (strlen(pszNewName) >= kcePerClu)
+void Xxfs::Link(FileStat &vStat, uint32_t lin, uint32_t linNewPar, const char *pszNewName) {
+    if (strlen(pszNewName) >= kcbNameBuf)
         throw Exception {ENAMETOOLONG};
     auto pi = X_GetInode(lin);
     if (pi->IsDir())
@@ -234,18 +316,25 @@ void Xxfs::Link(uint32_t lin, uint32_t linNewPar, const char *pszNewName) {
     auto piNewPar = X_GetInode(linNewPar);
     if (!piNewPar->IsDir())
         throw Exception {ENOTDIR};
+    x_vNameFilter.Add(linNewPar, pszNewName);
     OpenedDir vDir(this, piNewPar, linNewPar);
     vDir.Insert(pszNewName, lin, pi->uMode, DirPolicy::kNone);
+    pi = X_GetInode(lin);
     ++pi->cLink;
+    FillStat(vStat, lin, pi);
+    x_vInoCache.IncLookup(lin);
 }
 
 void Xxfs::Truncate(uint32_t lin, off_t cbNewSize) {
     auto pi = X_GetInode(lin);
     if (pi->IsDir())
         throw Exception {EISDIR};
-    if ((size_t) cbNewSize>= kcbMaxSize)
+    if ((uint64_t) cbNewSize > kcbMaxFile)
         throw Exception {EINVAL};
+    if ((uint64_t) cbNewSize < pi->cbSize)
+        X_ZeroTail(lin, pi, (uint64_t) cbNewSize);
     pi->cbSize = (uint64_t) cbNewSize;
+    Y_DelayDrop(lin, (uint32_t) ((pi->cbSize + kcbCluSize - 1) / kcbCluSize));
     Y_FileShrink(pi);
 }
 
@@ -281,7 +370,8 @@ OpenedFile *Xxfs::Open(uint32_t lin, fuse_file_info *pInfo) {
     }
     else
         pInfo->direct_io = false;
-    return new OpenedFile(this, pi, lin, bWrite, bAppend, bDirect);
+    auto pFile = x_vFilePool.New(this, pi, lin, bWrite, bAppend, bDirect);
+    return pFile;
 }
 
 uint64_t Xxfs::Read(OpenedFile *pFile, void *pBuf, uint64_t cbSize, uint64_t cbOff) {
@@ -301,104 +391,313 @@ uint64_t Xxfs::Write(OpenedFile *pFile, const void *pBuf, uint64_t cbSize, uint6
         throw Exception {EACCES};
     if (pFile->bAppend)
         cbOff = pFile->pi->cbSize;
+    if (cbOff >= kcbMaxFile)
+        throw Exception {EFBIG};
+    cbSize = std::min(cbSize, kcbMaxFile - cbOff);
+    // sequential extension
+    if (cbOff <= pFile->pi->cbSize && cbOff + cbSize > pFile->pi->cbSize)
+        pFile->DoPrealloc((uint32_t) (cbOff / kcbCluSize), (uint32_t) ((cbOff + cbSize + kcbCluSize - 1) / kcbCluSize));
     auto cbRes = pFile->DoWrite(pBuf, cbSize, cbOff);
     if (cbOff + cbRes > pFile->pi->cbSize)
         pFile->pi->cbSize = cbOff + cbRes;
+    if (pFile->bDirect)
+        Y_DelayFlush(pFile->lin, pFile);
+    else if (x_ccDelayed >= kccDelayMax)
+        Y_DelayFlushAll();
     return cbRes;
 }
 
 void Xxfs::Release(OpenedFile *pFile) noexcept {
     auto pi = pFile->pi;
-    delete pFile;
+    auto lin = pFile->lin;
+    Y_DelayFlush(lin, pFile);
+    pFile->DoUnreserve();
+    x_vFilePool.Delete(pFile);
     Y_FileShrink(pi);
+    x_vecStale.emplace_back(lin);
 }
 
-void Xxfs::FSync(OpenedFile *pFile) noexcept {
+void Xxfs::Flush(OpenedFile *pFile) {
+    if (!Y_DelayFlush(pFile->lin, pFile))
+        throw Exception {ENOSPC};
+}
+
+void Xxfs::FSync(OpenedFile *pFile) {
+    auto bOk = Y_DelayFlush(pFile->lin, pFile);
+    Y_DelaySync(pFile->lin);
     pFile->DoSync();
+    if (!bOk)
+        throw Exception {ENOSPC};
 }
 
 OpenedDir *Xxfs::OpenDir(uint32_t lin) {
     auto pi = X_GetInode(lin);
     if (!pi->IsDir())
         throw Exception {ENOTDIR};
-    return new OpenedDir(this, pi, lin);
+    auto pDir = x_vDirPool.New(this, pi, lin);
+    ++x_mapDirOpen[lin];
+    return pDir;
 }
 
-void Xxfs::ReadDir(OpenedDir *pDir, void *pBuf, fuse_fill_dir_t fnFill, off_t vOff) {
+void Xxfs::ReadDir(OpenedDir *pDir, const FnFillDir &fnFill, off_t vOff) {
     auto vNextOff = pDir->IterSeek(vOff);
     while (vNextOff != OpenedDir::kItEnd) {
         FileStat vStat;
         auto pszName = pDir->IterGet(vStat);
-        char szName[kcePerClu];
+        char szName[kcbNameBuf];
         strcpy(szName, pszName);
         vNextOff = pDir->IterNext();
-        if (fnFill(pBuf, szName, &vStat, vNextOff, {}))
+        if (fnFill(szName, vStat, vNextOff))
             break;
     }
 }
 
-void Xxfs::ReleaseDir(OpenedDir *pDir) noexcept {
-    pDir->Shrink();
-    delete pDir;
+void Xxfs::ReadDirPlus(OpenedDir *pDir, const FnFillDir &fnFill, off_t vOff) {
+    auto vNextOff = pDir->IterSeek(vOff);
+    while (vNextOff != OpenedDir::kItEnd) {
+        FileStat vStat;
+        auto pszName = pDir->IterGet(vStat);
+        char szName[kcbNameBuf];
+        strcpy(szName, pszName);
+        vNextOff = pDir->IterNext();
+        auto lin = (uint32_t) vStat.st_ino;
+        FillStat(vStat, lin, X_GetInode(lin));
+        if (fnFill(szName, vStat, vNextOff))
+            return;
+        x_vInoCache.IncLookup(lin);
+    }
+}
+
+void Xxfs::ReleaseDir(OpenedDir *pDir) {
+    auto it = x_mapDirOpen.find(pDir->lin);
+    if (!--it->second) {
+        x_mapDirOpen.erase(it);
+        pDir->Shrink();
+        Y_FileShrink(pDir->pi);
+    }
+    x_vDirPool.Delete(pDir);
 }
 
 void Xxfs::StatFs(VfsStat &vStat) const noexcept {
     vStat.f_bsize = (unsigned long) kcbCluSize;
     vStat.f_frsize = (unsigned long) kcbCluSize;
     vStat.f_blocks = (fsblkcnt_t) x_spcMeta->ccTotal;
-    vStat.f_bfree = (fsblkcnt_t) (x_spcMeta->ccTotal - x_spcMeta->ccUsed);
-    vStat.f_bavail = (fsblkcnt_t) (x_spcMeta->ccTotal - x_spcMeta->ccUsed);
+    vStat.f_bfree = (fsblkcnt_t) AvailClu();
+    vStat.f_bavail = (fsblkcnt_t) AvailClu();
     vStat.f_files = (fsfilcnt_t) x_spcMeta->ciTotal;
     vStat.f_ffree = (fsfilcnt_t) (x_spcMeta->ciTotal - x_spcMeta->ciUsed);
     vStat.f_favail = (fsfilcnt_t) (x_spcMeta->ciTotal - x_spcMeta->ciUsed);
-    vStat.f_namemax = (unsigned long) (kcePerClu - 1);
+    vStat.f_namemax = (unsigned long) (kcbNameBuf - 1);
 }
 
-OpenedFile *Xxfs::Create(uint32_t linPar, const char *pszName) {
-    if (strlen(pszName) >= kcePerClu)
+std::pair<uint32_t, OpenedFile *> Xxfs::Create(FileStat &vStat, uint32_t linPar, const char *pszName) {
+    if (strlen(pszName) >= kcbNameBuf)
         throw Exception {ENAMETOOLONG};
     auto piPar = X_GetInode(linPar);
     if (!piPar->IsDir())
         throw Exception {ENOTDIR};
-    auto lin = Y_AllocIno();
+    auto lin = Y_AllocIno(linPar, false);
     auto pi = X_GetInode(lin);
     memset(pi, 0, sizeof(Inode));
     pi->uMode = S_IFREG | 0777;
     pi->cLink = 1;
     try {
+        x_vNameFilter.Add(linPar, pszName);
         OpenedDir vDir(this, piPar, linPar);
         vDir.Insert(pszName, lin, pi->uMode, DirPolicy::kNone);
-        return new OpenedFile(this, pi, lin, true, false, false);
     }
     catch (...) {
         Y_UnlinkIno(lin, pi);
         throw;
     }
+    pi = X_GetInode(lin);
+    FillStat(vStat, lin, pi);
+    x_vInoCache.IncLookup(lin);
+    auto pFile = x_vFilePool.New(this, pi, lin, true, false, false);
+    return {lin, pFile};
+}
+
+uint64_t Xxfs::CopyFileRange(
+    OpenedFile *pIn, uint64_t cbOffIn,
+    OpenedFile *pOut, uint64_t cbOffOut,
+    uint64_t cbSize
+) {
+    if (!pOut->bWrite)
+        throw Exception {EBADF};
+    auto piIn = pIn->pi;
+    auto piOut = pOut->pi;
+    if (cbOffIn >= piIn->cbSize)
+        return 0;
+    cbSize = std::min(piIn->cbSize - cbOffIn, cbSize);
+    if (cbOffOut + cbSize > kcbMaxFile)
+        throw Exception {EFBIG};
+    if (pIn->lin == pOut->lin && cbOffIn < cbOffOut + cbSize && cbOffOut < cbOffIn + cbSize)
+        throw Exception {EINVAL};
+    // sharing works on placed clusters only
+    if (!Y_DelayFlush(pIn->lin, pIn) || !Y_DelayFlush(pOut->lin, pOut))
+        throw Exception {ENOSPC};
+    uint64_t cbDone = 0;
+    if (cbOffIn % kcbCluSize == cbOffOut % kcbCluSize) {
+        // copy the partial head, share the whole clusters, leave the tail to be copied
+        auto cbHead = std::min((kcbCluSize - cbOffIn % kcbCluSize) % kcbCluSize, cbSize);
+        cbDone = X_CopyBytes(pIn, cbOffIn, pOut, cbOffOut, cbHead);
+        if (cbDone == cbHead) {
+            auto cc = Y_FileShare(
+                piIn, (uint32_t) ((cbOffIn + cbDone) / kcbCluSize),
+                piOut, (uint32_t) ((cbOffOut + cbDone) / kcbCluSize),
+                (uint32_t) ((cbSize - cbDone) / kcbCluSize)
+            );
+            cbDone += (uint64_t) kcbCluSize * cc;
+        }
+        else
+            cbSize = cbDone;
+    }
+    cbDone += X_CopyBytes(pIn, cbOffIn + cbDone, pOut, cbOffOut + cbDone, cbSize - cbDone);
+    if (cbOffOut + cbDone > piOut->cbSize)
+        piOut->cbSize = cbOffOut + cbDone;
+    return cbDone;
 }
 
-uint32_t Xxfs::AvailClu() const noexcept {
-    return x_spcMeta->ccTotal - x_spcMeta->ccUsed;
+std::vector<uint32_t> Xxfs::TakeStale() {
+    std::vector<uint32_t> vecLin;
+    std::sort(x_vecStale.begin(), x_vecStale.end());
+    x_vecStale.erase(std::unique(x_vecStale.begin(), x_vecStale.end()), x_vecStale.end());
+    for (auto lin : x_vecStale)
+        if (x_vInoCache.IsLooked(lin))
+            vecLin.emplace_back(lin);
+    x_vecStale.clear();
+    return vecLin;
+}
+
+Lcn Xxfs::AvailClu() const noexcept {
+    return x_spcMeta->ccTotal - x_spcMeta->ccUsed - x_ccDelayed;
 }
 
 inline Inode *Xxfs::X_GetInode(uint32_t lin) noexcept {
-    auto vin = lin % kciPerClu;
-    auto vcn = lin / kciPerClu;
-    return &x_vInoCluCache.At<InodeCluster>(x_spcMeta->lcnIno + vcn)->aInos[vin];
+    return &x_upInos[lin];
+}
+
+void Xxfs::X_DirShrink(OpenedDir &vDir) {
+    if (!x_mapDirOpen.count(vDir.lin))
+        vDir.Shrink();
+}
+
+std::pair<uint32_t, uint16_t> Xxfs::X_Lookup(uint32_t linPar, std::string_view svName, DirPolicy vPolicy) {
+    auto vEnt = x_vPathCache.Get(linPar, svName);
+    if (!vEnt.first) {
+        if (!x_vNameFilter.MayHave(linPar, svName))
+            return {0, 0};
+        DirCursor vCur(this, X_GetInode(linPar));
+        vEnt = vCur.Lookup(svName, DirPolicy::kAny);
+        if (!vEnt.first) {
+            // the next misses are answered by the filter
+            if (!x_vNameFilter.Has(linPar))
+                X_FilterBuild(linPar);
+            return {0, 0};
+        }
+        x_vPathCache.Put(linPar, svName, vEnt.first, vEnt.second);
+    }
+    if (vPolicy == DirPolicy::kDir && !S_ISDIR(vEnt.second))
+        throw Exception {ENOTDIR};
+    return vEnt;
+}
+
+void Xxfs::X_FilterBuild(uint32_t linPar) {
+    std::vector<std::string> vecNames;
+    OpenedDir vDir(this, X_GetInode(linPar), linPar);
+    for (auto vOff = vDir.IterSeek(OpenedDir::kItBegin); vOff != OpenedDir::kItEnd; vOff = vDir.IterNext()) {
+        FileStat vStat;
+        vecNames.emplace_back(vDir.IterGet(vStat));
+    }
+    x_vNameFilter.Build(linPar, (uint32_t) vecNames.size());
+    for (auto &sName : vecNames)
+        x_vNameFilter.Add(linPar, sName);
 }
 
-ShrPtr<InodeCluster> Xxfs::Y_MapInoClu(uint32_t vcn) noexcept {
-    return x_vCluCache.At<InodeCluster>(x_spcMeta->lcnIno + vcn);
+void Xxfs::X_ZeroTail(uint32_t lin, Inode *pi, uint64_t cbNewSize) {
+    auto vcn = (uint32_t) (cbNewSize / kcbCluSize);
+    auto cbOff = (uint32_t) (cbNewSize % kcbCluSize);
+    if (auto pc = Y_DelayGet(lin, vcn)) {
+        memset(pc->aData + cbOff, 0, kcbCluSize - cbOff);
+        return;
+    }
+    ShrPtr<IndexCluster> spc;
+    auto pLcn = Y_FileSlot(pi, vcn, false, spc);
+    if (!pLcn || !*pLcn || (!cbOff && !Y_IsCmp(pLcn, vcn)))
+        return;
+    // expands a compressed unit and copies a shared cluster
+    FilePtrW fp;
+    auto spcData = fp.Seek<ByteCluster>(this, pi, vcn);
+    memset(spcData->aData + cbOff, 0, kcbCluSize - cbOff);
+}
+
+uint64_t Xxfs::X_CopyBytes(
+    OpenedFile *pIn, uint64_t cbOffIn,
+    OpenedFile *pOut, uint64_t cbOffOut,
+    uint64_t cbSize
+) {
+    ByteCluster cluBuf;
+    uint64_t cbDone = 0;
+    while (cbDone < cbSize) {
+        auto cbChunk = std::min((uint64_t) kcbCluSize, cbSize - cbDone);
+        pIn->DoRead(cluBuf.aData, cbChunk, cbOffIn + cbDone);
+        auto cbRes = pOut->DoWrite(cluBuf.aData, cbChunk, cbOffOut + cbDone);
+        cbDone += cbRes;
+        if (cbRes < cbChunk)
+            break;
+    }
+    return cbDone;
 }
 
-inline uint32_t Xxfs::Y_AllocIno() {
-    auto lin = x_vInoAlloc.Alloc();
+inline uint32_t Xxfs::Y_AllocIno(uint32_t linPar, bool bDir) {
+    auto lin = (uint32_t) x_vInoAlloc.Alloc(Y_InoGoal(linPar, bDir));
     ++x_spcMeta->ciUsed;
     return lin;
 }
 
+uint32_t Xxfs::Y_InoGoal(uint32_t linPar, bool bDir) noexcept {
+    auto linNear = linPar / kciPerClu * kciPerClu;
+    if (!bDir)
+        return linNear;
+    auto cGrp = x_vInoAlloc.CountGroups();
+    auto ciAvg = (x_spcMeta->ciTotal - x_spcMeta->ciUsed) / cGrp;
+    auto ccAvg = AvailClu() / x_vCluAlloc.CountGroups();
+    // a group with at least uQuarters / 4 of the average free inodes and clusters
+    auto fnRoomy = [&] (uint32_t vGrp, uint32_t uQuarters) {
+        return (uint64_t) x_vInoAlloc.FreeIn(vGrp) * 4 >= (uint64_t) ciAvg * uQuarters &&
+            (uint64_t) x_vCluAlloc.FreeIn(vGrp) * 4 >= (uint64_t) ccAvg * uQuarters;
+    };
+    if (linPar) {
+        auto vGrpPar = x_vInoAlloc.GroupOf(linPar);
+        for (uint32_t i = 0; i < cGrp; ++i) {
+            auto vGrp = (vGrpPar + i) % cGrp;
+            if (fnRoomy(vGrp, 1))
+                return i ? (uint32_t) x_vInoAlloc.GroupStart(vGrp) : linNear;
+        }
+        return linNear;
+    }
+    for (uint32_t i = 0; i < cGrp; ++i) {
+        auto vGrp = (x_vGrpDir + i) % cGrp;
+        if (fnRoomy(vGrp, 3)) {
+            x_vGrpDir = (vGrp + 1) % cGrp;
+            return (uint32_t) x_vInoAlloc.GroupStart(vGrp);
+        }
+    }
+    return linNear;
+}
+
 void Xxfs::Y_UnlinkIno(uint32_t lin, Inode *pi) noexcept {
     if (--pi->cLink)
         return;
+    // still open or cached by the kernel, freed on forget
+    if (x_vInoCache.IsLooked(lin))
+        return;
+    Y_FreeIno(lin, pi);
+}
+
+void Xxfs::Y_FreeIno(uint32_t lin, Inode *pi) noexcept {
+    Y_DelayDrop(lin);
+    x_mapUnsynced.erase(lin);
     pi->cbSize = 0;
     Y_FileShrink(pi);
     assert(!pi->ccSize);
@@ -406,16 +705,118 @@ void Xxfs::Y_UnlinkIno(uint32_t lin, Inode *pi) noexcept {
     --x_spcMeta->ciUsed;
 }
 
-void Xxfs::Y_FileFreeClu(Inode *pi, uint32_t &lcn) noexcept {
+Lcn Xxfs::Y_Reserve(Lcn lcnHint, uint32_t cc) {
+    Lcn lcn = 0;
+    // skip the windows in the way, a few times at most
+    for (int i = 0; i < 4; ++i) {
+        lcn = x_vCluAlloc.FindRun(lcnHint, cc);
+        auto it = x_mapResv.lower_bound(lcn + cc);
+        if (it == x_mapResv.begin() || std::prev(it)->second <= lcn)
+            break;
+        lcnHint = std::prev(it)->second;
+    }
+    x_mapResv.emplace(lcn, lcn + cc);
+    return lcn;
+}
+
+void Xxfs::Y_Unreserve(Lcn lcn) noexcept {
+    x_mapResv.erase(lcn);
+}
+
+ShrPtr<void> Xxfs::Y_FileCowClu(Inode *pi, Lcn &lcn, Lcn lcnHint) {
+    auto lcnOld = lcn;
+    auto spOld = Y_Map<void>(lcnOld);
+    auto sp = Y_FileAllocClu<void>(pi, lcn, lcnHint);
+    memcpy(sp.get(), spOld.get(), kcbCluSize);
+    Y_CluRelease(lcnOld);
+    --pi->ccSize;
+    ++x_uShareGen;
+    return sp;
+}
+
+Lcn *Xxfs::Y_FileSlot(Inode *pi, uint32_t vcn, bool bAlloc, ShrPtr<IndexCluster> &spc) {
+    if (vcn < kvcnIdx1)
+        return &pi->lcnIdx0[vcn];
+    Lcn *pLcn;
+    uint32_t ccPerIdx;
+    if (vcn < kvcnIdx2) {
+        vcn -= kvcnIdx1;
+        pLcn = &pi->lcnIdx1;
+        ccPerIdx = 1;
+    }
+    else if (vcn < kvcnIdx3) {
+        vcn -= kvcnIdx2;
+        pLcn = &pi->lcnIdx2;
+        ccPerIdx = kccIdx1;
+    }
+    else {
+        vcn -= kvcnIdx3;
+        pLcn = &pi->lcnIdx3;
+        ccPerIdx = kccIdx2;
+    }
+    for (;;) {
+        if (*pLcn)
+            spc = Y_Map<IndexCluster>(*pLcn);
+        else if (bAlloc)
+            spc = Y_FileAllocClu<IndexCluster>(pi, *pLcn);
+        else
+            return nullptr;
+        pLcn = &spc->aLcns[vcn / ccPerIdx];
+        vcn %= ccPerIdx;
+        if (ccPerIdx == 1)
+            return pLcn;
+        ccPerIdx /= kcnPerClu;
+    }
+}
+
+uint32_t Xxfs::Y_FileShare(Inode *piIn, uint32_t vcnIn, Inode *piOut, uint32_t vcnOut, uint32_t cc) {
+    ++x_uShareGen;
+    ShrPtr<IndexCluster> spcIn;
+    ShrPtr<IndexCluster> spcOut;
+    for (uint32_t i = 0; i < cc; ++i) {
+        // clusters of a compressed unit are never shared
+        auto pLcnIn = Y_FileSlot(piIn, vcnIn + i, false, spcIn);
+        if (pLcnIn && Y_IsCmp(pLcnIn, vcnIn + i))
+            return i;
+        auto lcn = pLcnIn ? *pLcnIn : 0;
+        auto pLcnOut = Y_FileSlot(piOut, vcnOut + i, lcn != 0, spcOut);
+        if (pLcnOut && Y_IsCmp(pLcnOut, vcnOut + i))
+            return i;
+        if (!pLcnOut || *pLcnOut == lcn)
+            continue;
+        if (lcn)
+            Y_RefInc(lcn);
+        Y_FileFreeClu(piOut, *pLcnOut);
+        *pLcnOut = lcn;
+        if (lcn)
+            ++piOut->ccSize;
+    }
+    return cc;
+}
+
+void Xxfs::Y_FileFreeClu(Inode *pi, Lcn &lcn) noexcept {
     if (!lcn)
         return;
-    x_vCluAlloc.Free(lcn);
+    if (lcn == kLcnCmp) {
+        // the tail of a compressed unit holds no cluster
+        lcn = 0;
+        return;
+    }
+    Y_CluRelease(lcn);
     lcn = 0;
     --pi->ccSize;
+}
+
+void Xxfs::Y_CluRelease(Lcn lcn) noexcept {
+    // the last reference may be the one held by the dedup index
+    if (Y_RefDec(lcn) && (!x_spcMeta->iDedup.ccSize || Y_RefGet(lcn) || !Y_DedupDrop(lcn)))
+        return;
+    X_CmpForget(lcn);
+    x_vCluAlloc.Free(lcn);
     --x_spcMeta->ccUsed;
 }
 
-void Xxfs::Y_FileFreeIdx1(Inode *pi, uint32_t &lcn, uint32_t vcnFrom) noexcept {
+void Xxfs::Y_FileFreeIdx1(Inode *pi, Lcn &lcn, uint32_t vcnFrom) noexcept {
     if (!lcn)
         return;
     {
@@ -427,7 +828,7 @@ void Xxfs::Y_FileFreeIdx1(Inode *pi, uint32_t &lcn, uint32_t vcnFrom) noexcept {
         Y_FileFreeClu(pi, lcn);
 }
 
-void Xxfs::Y_FileFreeIdx2(Inode *pi, uint32_t &lcn, uint32_t vcnFrom) noexcept {
+void Xxfs::Y_FileFreeIdx2(Inode *pi, Lcn &lcn, uint32_t vcnFrom) noexcept {
     if (!lcn)
         return;
     {
@@ -442,7 +843,7 @@ void Xxfs::Y_FileFreeIdx2(Inode *pi, uint32_t &lcn, uint32_t vcnFrom) noexcept {
         Y_FileFreeClu(pi, lcn);
 }
 
-void Xxfs::Y_FileFreeIdx3(Inode *pi, uint32_t &lcn, uint32_t vcnFrom) noexcept {
+void Xxfs::Y_FileFreeIdx3(Inode *pi, Lcn &lcn, uint32_t vcnFrom) noexcept {
     if (!lcn)
         return;
     {
@@ -458,26 +859,374 @@ void Xxfs::Y_FileFreeIdx3(Inode *pi, uint32_t &lcn, uint32_t vcnFrom) noexcept {
 }
 
 void Xxfs::Y_FileShrink(Inode *pi) noexcept {
-    auto vcnEnd = (uint32_t) (pi->cbSize + kcbCluSize - 1) / kcbCluSize;
+    // a directory keeps its edge index past kvcnIdx3 until it is removed
+    static_assert(kvcnDirIdx == kvcnIdx3);
+    auto bIdx3 = !pi->IsDir() || !pi->cbSize;
+    auto vcnEnd = (uint32_t) ((pi->cbSize + kcbCluSize - 1) / kcbCluSize);
+    if (vcnEnd % kccCmpUnit) {
+        // a compressed unit is kept whole
+        ShrPtr<IndexCluster> spc;
+        auto pLcn = Y_FileSlot(pi, vcnEnd, false, spc);
+        if (pLcn && Y_IsCmp(pLcn, vcnEnd))
+            vcnEnd += kccCmpUnit - vcnEnd % kccCmpUnit;
+    }
     if (vcnEnd <= kvcnIdx1) {
         for (uint32_t i = vcnEnd; i < kvcnIdx1; ++i)
             Y_FileFreeClu(pi, pi->lcnIdx0[i]);
         Y_FileFreeIdx1(pi, pi->lcnIdx1);
         Y_FileFreeIdx2(pi, pi->lcnIdx2);
-        Y_FileFreeIdx3(pi, pi->lcnIdx3);
+        if (bIdx3)
+            Y_FileFreeIdx3(pi, pi->lcnIdx3);
     }
     else if (vcnEnd <= kvcnIdx2) {
         Y_FileFreeIdx1(pi, pi->lcnIdx1, vcnEnd - kvcnIdx1);
         Y_FileFreeIdx2(pi, pi->lcnIdx2);
-        Y_FileFreeIdx3(pi, pi->lcnIdx3);
+        if (bIdx3)
+            Y_FileFreeIdx3(pi, pi->lcnIdx3);
     }
     else if (vcnEnd <= kvcnIdx3) {
         Y_FileFreeIdx2(pi, pi->lcnIdx2, vcnEnd - kvcnIdx2);
-        Y_FileFreeIdx3(pi, pi->lcnIdx3);
+        if (bIdx3)
+            Y_FileFreeIdx3(pi, pi->lcnIdx3);
     }
-    else {
-        Y_FileFreeIdx3(pi, pi->lcnIdx3);
+    else if (bIdx3)
+        Y_FileFreeIdx3(pi, pi->lcnIdx3, vcnEnd - kvcnIdx3);
+}
+
+ByteCluster *Xxfs::Y_DelayGet(uint32_t lin, uint32_t vcn) noexcept {
+    if (x_mapDelayed.empty())
+        return nullptr;
+    auto it = x_mapDelayed.find(lin);
+    if (it == x_mapDelayed.end())
+        return nullptr;
+    auto itClu = it->second.find(vcn);
+    return itClu == it->second.end() ? nullptr : itClu->second.get();
+}
+
+ByteCluster *Xxfs::Y_DelayNew(uint32_t lin, uint32_t vcn) {
+    if (AvailClu() < kccDelayFree)
+        return nullptr;
+    auto &upc = x_mapDelayed[lin][vcn];
+    assert(!upc);
+    upc = std::make_unique<ByteCluster>();
+    ++x_ccDelayed;
+    return upc.get();
+}
+
+bool Xxfs::Y_DelayFlush(uint32_t lin, const OpenedFile *pFile) noexcept {
+    auto it = x_mapDelayed.find(lin);
+    if (it == x_mapDelayed.end())
+        return true;
+    auto &mapClus = it->second;
+    auto pi = X_GetInode(lin);
+    FilePtrW fp;
+    try {
+        auto vcnNext = ~uint32_t {0};
+        while (!mapClus.empty()) {
+            auto itClu = mapClus.begin();
+            auto vcn = itClu->first;
+            if (x_bCompress && vcn % kccCmpUnit == 0 && Y_CmpStore(lin, pi, mapClus)) {
+                vcnNext = ~uint32_t {0};
+                continue;
+            }
+            if (vcn != vcnNext) {
+                // a new run of vcns, find a free run of lcns to hold it
+                uint32_t cc = 1;
+                for (auto itRun = std::next(itClu); itRun != mapClus.end() && itRun->first == vcn + cc; ++itRun)
+                    ++cc;
+                auto lcnHint = pFile ? pFile->ResvLcn(vcn) : 0;
+                if (!lcnHint) {
+                    ShrPtr<IndexCluster> spc;
+                    auto pLcnPrev = vcn ? Y_FileSlot(pi, vcn - 1, false, spc) : nullptr;
+                    auto lcnPrev = pLcnPrev ? *pLcnPrev : 0;
+                    lcnHint = lcnPrev ? lcnPrev + 1 : Y_CluGoal(pi);
+                }
+                fp.Hint(x_vCluAlloc.FindRun(lcnHint, cc));
+            }
+            // the reservation turns into a real cluster, the buffer goes once the cluster is written
+            --x_ccDelayed;
+            Lcn lcn;
+            try {
+                lcn = X_DelayPlace(pi, fp, vcn, itClu->second.get());
+            }
+            catch (...) {
+                ++x_ccDelayed;
+                throw;
+            }
+            if (lcn)
+                Y_DelayWritten(lin, lcn);
+            mapClus.erase(itClu);
+            vcnNext = vcn + 1;
+        }
     }
+    catch (Exception &) {
+        // out of space despite the margin, the rest stays buffered and is retried by the next flush
+    }
+    x_vecStale.emplace_back(lin);
+    if (!mapClus.empty())
+        return false;
+    x_mapDelayed.erase(it);
+    return true;
+}
+
+bool Xxfs::Y_DelayFlushAll() noexcept {
+    auto bOk = true;
+    for (auto it = x_mapDelayed.begin(); it != x_mapDelayed.end();) {
+        // only the entry of lin may be erased
+        auto lin = (it++)->first;
+        bOk = Y_DelayFlush(lin) && bOk;
+    }
+    return bOk;
 }
 
+std::vector<std::tuple<std::string, uint32_t, uint16_t>> Xxfs::X_ListV0(Inode *pi) {
+    std::vector<std::tuple<std::string, uint32_t, uint16_t>> vecEnts;
+    if (!pi->ccSize)
+        return vecEnts;
+    FilePtrR fp;
+    auto fnEnt = [&] (uint32_t len) {
+        return fp.Seek<DirClusterV0>(this, pi, len / kcePerCluV0)->aEnts[len % kcePerCluV0];
+    };
+    // depth first, an entry comes with the length of the name before its key byte
+    // the children of an entry are walked before its next sibling, so the bytes before it stay in place
+    std::vector<std::pair<uint32_t, uint32_t>> vecStk;
+    char szName[kcbNameBuf];
+    if (auto len = fnEnt(0).lenChild)
+        vecStk.emplace_back(len, 0);
+    // a corrupt trie cannot loop forever
+    auto ceLeft = (uint64_t) pi->ccSize * kcePerCluV0;
+    while (!vecStk.empty() && ceLeft--) {
+        auto [len, cb] = vecStk.back();
+        vecStk.pop_back();
+        auto ve = fnEnt(len);
+        if (cb + 1 >= kcbNameBuf)
+            continue;
+        szName[cb] = (char) ve.byKey;
+        if (ve.lenNext)
+            vecStk.emplace_back(ve.lenNext, cb);
+        if (ve.lenChild)
+            vecStk.emplace_back(ve.lenChild, cb + 1);
+        if (ve.bExist)
+            vecEnts.emplace_back(std::string(szName, cb + 1), ve.linFile, ve.uMode);
+    }
+    return vecEnts;
 }
+
+Lcn Xxfs::X_DelayPlace(Inode *pi, FilePtrW &fp, uint32_t vcn, const ByteCluster *pc) {
+    auto uHash = x_bDedup ? HashCluster(pc) : 0;
+    if (auto lcnDup = x_bDedup ? Y_DedupFind(pc, uHash) : 0) {
+        ShrPtr<IndexCluster> spcIdx;
+        auto pLcn = Y_FileSlot(pi, vcn, true, spcIdx);
+        Y_RefInc(lcnDup);
+        *pLcn = lcnDup;
+        ++pi->ccSize;
+        return 0;
+    }
+    auto spc = fp.Seek<ByteCluster>(this, pi, vcn);
+    memcpy(spc.get(), pc, kcbCluSize);
+    if (x_bDedup)
+        Y_DedupAdd(uHash, fp.CurLcn());
+    return fp.CurLcn();
+}
+
+void Xxfs::Y_DelayWritten(uint32_t lin, Lcn lcn) {
+    auto &vecRuns = x_mapUnsynced[lin];
+    if (!vecRuns.empty() && vecRuns.back().first + vecRuns.back().second == lcn)
+        ++vecRuns.back().second;
+    else
+        vecRuns.emplace_back(lcn, 1);
+    if (vecRuns.size() >= kcRunUnsynced)
+        Y_DelaySync(lin);
+}
+
+void Xxfs::Y_DelaySync(uint32_t lin) noexcept {
+    auto it = x_mapUnsynced.find(lin);
+    if (it == x_mapUnsynced.end())
+        return;
+    for (auto [lcn, cc] : it->second)
+        RunSync(x_vRf.Get(), lcn, cc);
+    x_mapUnsynced.erase(it);
+}
+
+void Xxfs::Y_DelayDrop(uint32_t lin, uint32_t vcnFrom) noexcept {
+    auto it = x_mapDelayed.find(lin);
+    if (it == x_mapDelayed.end())
+        return;
+    auto &mapClus = it->second;
+    auto itFrom = mapClus.lower_bound(vcnFrom);
+    x_ccDelayed -= (uint32_t) std::distance(itFrom, mapClus.end());
+    mapClus.erase(itFrom, mapClus.end());
+    if (mapClus.empty())
+        x_mapDelayed.erase(it);
+}
+
+ShrPtr<void> Xxfs::Y_CmpMap(const Lcn *pUnit, uint32_t idx) noexcept {
+    auto spu = X_CmpLoad(pUnit);
+    return ShrPtr<void>(spu, spu->aClus[idx].aData);
+}
+
+void Xxfs::Y_CmpExpand(Inode *pi, Lcn *pUnit) {
+    // the old clusters are freed only when every new one is in place
+    if (AvailClu() < kccCmpUnit)
+        throw Exception {ENOSPC};
+    auto spu = X_CmpLoad(pUnit);
+    Lcn aLcnsOld[kccCmpUnit];
+    std::copy(pUnit, pUnit + kccCmpUnit, aLcnsOld);
+    std::fill(pUnit, pUnit + kccCmpUnit, 0);
+    auto lcnHint = x_vCluAlloc.FindRun(aLcnsOld[0], kccCmpUnit);
+    for (uint32_t i = 0; i < kccCmpUnit; ++i) {
+        auto spc = Y_FileAllocClu<ByteCluster>(pi, pUnit[i], lcnHint);
+        memcpy(spc.get(), &spu->aClus[i], kcbCluSize);
+        lcnHint = pUnit[i] + 1;
+    }
+    for (auto &lcn : aLcnsOld)
+        Y_FileFreeClu(pi, lcn);
+    ++x_uShareGen;
+}
+
+bool Xxfs::Y_CmpStore(uint32_t lin, Inode *pi, std::map<uint32_t, std::unique_ptr<ByteCluster>> &mapClus) {
+    // every vcn of the unit inside the file must be buffered
+    auto itClu = mapClus.begin();
+    auto vcn = itClu->first;
+    auto vcnEnd = (pi->cbSize + kcbCluSize - 1) / kcbCluSize;
+    auto upu = std::make_unique<CmpUnit>();
+    uint32_t cc = 0;
+    for (; cc < kccCmpUnit && vcn + cc < vcnEnd; ++cc, ++itClu) {
+        if (itClu == mapClus.end() || itClu->first != vcn + cc)
+            return false;
+        memcpy(&upu->aClus[cc], itClu->second.get(), kcbCluSize);
+    }
+    // the unit must save at least one cluster
+    auto upBuf = std::make_unique<CmpUnit>();
+    auto pHead = reinterpret_cast<CmpHead *>(upBuf.get());
+    pHead->cbData = Compress(
+        reinterpret_cast<uint8_t *>(upu.get()), sizeof(CmpUnit),
+        reinterpret_cast<uint8_t *>(pHead + 1), (kccCmpUnit - 1) * kcbCluSize - sizeof(CmpHead)
+    );
+    if (!pHead->cbData)
+        return false;
+    auto ccData = (uint32_t) ((sizeof(CmpHead) + pHead->cbData + kcbCluSize - 1) / kcbCluSize);
+    ShrPtr<IndexCluster> spc;
+    auto pUnit = Y_FileSlot(pi, vcn, true, spc);
+    if (std::any_of(pUnit, pUnit + kccCmpUnit, [] (Lcn lcn) { return lcn != 0; }))
+        return false;
+    ShrPtr<IndexCluster> spcPrev;
+    auto pLcnPrev = vcn ? Y_FileSlot(pi, vcn - 1, false, spcPrev) : nullptr;
+    auto lcnPrev = pLcnPrev ? *pLcnPrev : 0;
+    auto lcnHint = x_vCluAlloc.FindRun(lcnPrev && lcnPrev != kLcnCmp ? lcnPrev + 1 : Y_CluGoal(pi), ccData);
+    // the reservations turn into the clusters of the unit
+    // the buffers go only when every cluster is in place
+    x_ccDelayed -= cc;
+    try {
+        for (uint32_t i = 0; i < ccData; ++i) {
+            auto spcData = Y_FileAllocClu<ByteCluster>(pi, pUnit[i], lcnHint);
+            memcpy(spcData.get(), &upBuf->aClus[i], kcbCluSize);
+            lcnHint = pUnit[i] + 1;
+        }
+    }
+    catch (...) {
+        for (uint32_t i = 0; i < ccData; ++i)
+            Y_FileFreeClu(pi, pUnit[i]);
+        x_ccDelayed += cc;
+        throw;
+    }
+    mapClus.erase(mapClus.begin(), itClu);
+    std::fill(pUnit + ccData, pUnit + kccCmpUnit, kLcnCmp);
+    for (uint32_t i = 0; i < ccData; ++i)
+        Y_DelayWritten(lin, pUnit[i]);
+    return true;
+}
+
+ShrPtr<CmpUnit> Xxfs::X_CmpLoad(const Lcn *pUnit) noexcept {
+    auto &vEnt = x_aCmpCache[pUnit[0] % kcCmpCache];
+    if (vEnt.first == pUnit[0] && vEnt.second)
+        return vEnt.second;
+    auto upBuf = std::make_unique<CmpUnit>();
+    uint32_t ccData = 0;
+    for (; ccData < kccCmpUnit && pUnit[ccData] != kLcnCmp; ++ccData)
+        memcpy(&upBuf->aClus[ccData], Y_Map<ByteCluster>(pUnit[ccData]).get(), kcbCluSize);
+    auto pHead = reinterpret_cast<const CmpHead *>(upBuf.get());
+    auto spu = std::make_shared<CmpUnit>();
+    auto bOk = pHead->cbData <= ccData * kcbCluSize - sizeof(CmpHead) && Decompress(
+        reinterpret_cast<const uint8_t *>(pHead + 1), pHead->cbData,
+        reinterpret_cast<uint8_t *>(spu.get()), sizeof(CmpUnit)
+    );
+    // a corrupt unit reads as zeros
+    if (!bOk)
+        memset(spu.get(), 0, sizeof(CmpUnit));
+    vEnt = {pUnit[0], spu};
+    return spu;
+}
+
+Lcn Xxfs::Y_DedupFind(const ByteCluster *pc, uint64_t uHash) noexcept {
+    if (!x_spcMeta->iDedup.ccSize)
+        return 0;
+    auto spc = x_fpDedupR.Seek<DedupCluster>(this, &x_spcMeta->iDedup, X_DedupBucket(uHash));
+    if (!spc)
+        return 0;
+    for (auto &vEnt : spc->aEnts)
+        if (vEnt.lcn && vEnt.uTag == (uint32_t) (uHash >> 32))
+            if (!memcmp(Y_Map<ByteCluster>(vEnt.lcn).get(), pc, kcbCluSize))
+                return vEnt.lcn;
+    return 0;
+}
+
+void Xxfs::Y_DedupAdd(uint64_t uHash, Lcn lcn) noexcept {
+    try {
+        auto spc = x_fpDedupW.Seek<DedupCluster>(this, &x_spcMeta->iDedup, X_DedupBucket(uHash));
+        auto pEnt = std::find_if(
+            std::begin(spc->aEnts), std::end(spc->aEnts),
+            [] (const DedupEnt &vEnt) { return !vEnt.lcn; }
+        );
+        // a full bucket forgets an entry picked by the hash
+        if (pEnt == std::end(spc->aEnts))
+            pEnt = &spc->aEnts[(uHash >> 32) % kcdePerClu];
+        Y_RefInc(lcn);
+        auto lcnOld = pEnt->lcn;
+        *pEnt = {(uint32_t) (uHash >> 32), lcn};
+        if (lcnOld)
+            Y_CluRelease(lcnOld);
+    }
+    catch (Exception &) {
+        // out of space, the cluster is just not indexed
+    }
+}
+
+bool Xxfs::Y_DedupDrop(Lcn lcn) noexcept {
+    // an indexed cluster is never written in place, so its hash still holds
+    auto uHash = HashCluster(Y_Map<ByteCluster>(lcn).get());
+    auto spc = x_fpDedupR.Seek<DedupCluster>(this, &x_spcMeta->iDedup, X_DedupBucket(uHash));
+    if (!spc)
+        return false;
+    for (auto &vEnt : spc->aEnts) {
+        if (vEnt.lcn == lcn) {
+            vEnt = {0, 0};
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t Xxfs::Y_RefGet(Lcn lcn) noexcept {
+    if (!x_spcMeta->iRefCnt.ccSize)
+        return 0;
+    auto spc = x_fpRefR.Seek<RefCntCluster>(this, &x_spcMeta->iRefCnt, (uint32_t) (lcn / kcrPerClu));
+    return spc ? spc->aRefs[lcn % kcrPerClu] : 0;
+}
+
+void Xxfs::Y_RefInc(Lcn lcn) {
+    auto spc = x_fpRefW.Seek<RefCntCluster>(this, &x_spcMeta->iRefCnt, (uint32_t) (lcn / kcrPerClu));
+    ++spc->aRefs[lcn % kcrPerClu];
+}
+
+bool Xxfs::Y_RefDec(Lcn lcn) noexcept {
+    if (!x_spcMeta->iRefCnt.ccSize)
+        return false;
+    auto spc = x_fpRefR.Seek<RefCntCluster>(this, &x_spcMeta->iRefCnt, (uint32_t) (lcn / kcrPerClu));
+    if (!spc || !spc->aRefs[lcn % kcrPerClu])
+        return false;
+    --spc->aRefs[lcn % kcrPerClu];
+    return true;
+}
+
+}}
@@ -5,105 +5,245 @@
 
 #include "BitmapAllocator.hpp"
 #include "ClusterCache.hpp"
+#include "HandlePool.hpp"
+#include "InodeCache.hpp"
+#include "NameFilter.hpp"
 #include "OpenedFile.hpp"
 #include "OpenedDir.hpp"
+#include "PathCache.hpp"
 #include "Raii.hpp"
 
-namespace xxfs {
+namespace xxfs { inline namespace XXFS_CLU_NS {
+
+// returns true when no more entry fits
+using FnFillDir = std::function<bool (const char *pszName, const FileStat &vStat, off_t vNextOff)>;
 
 class Xxfs {
 private:
     friend class PathCache;
     friend class InodeCache;
+    friend class OpenedFile;
+    friend class OpenedDir;
     friend FilePtrR;
     friend FilePtrW;
     
 public:
-    Xxfs(RaiiFile &&vRf, ShrPtr<MetaCluster> &&spcMeta);
+    // bCompress: clusters flushed from the delay buffer are compressed when it saves space
+    // bDedup: clusters flushed from the delay buffer share identical indexed clusters
+    Xxfs(RaiiFile &&vRf, ShrPtr<MetaCluster> &&spcMeta, bool bCompress = false, bool bDedup = false, bool bHuge = false);
+
+public:
+    // convert an image older than kVersion in place, before anything else is done
+    // ENOSPC leaves the image untouched
+    void Upgrade();
 
 public:
     uint32_t LinAt(const char *pszPath);
     uint32_t LinPar(const char *&pszPath);
 
-    // returns inode number, increase cLookup when hit
-    //uint32_t Lookup(FileStat &vStat, uint32_t linPar, const char *pszName);
-    //void Forget(uint32_t lin, uint64_t cLookup);
+    // returns inode number, 0 if not exist (the root is in no directory), increase cLookup when hit
+    // entries returned by MkDir, SymLink, Link and Create count as looked up as well
+    uint32_t Lookup(FileStat &vStat, uint32_t linPar, const char *pszName);
+    // an inode unlinked while looked up is freed when forgotten
+    void Forget(uint32_t lin, uint64_t cLookup) noexcept;
+    // the kernel forgets every inode on unmount
+    void ForgetAll();
     void GetAttr(FileStat &vStat, uint32_t lin);
-    //void SetAttr(FileStat &vStat, FileStat *pStat, uint32_t lin, int nFlags, fuse_file_info *pInfo);
-    //const char *ReadLink(uint32_t lin);
+    // only the size can be set, times are ignored, ENOSYS otherwise, pFile is the handle it is set through if any
+    void SetAttr(FileStat &vStat, uint32_t lin, const FileStat &vNew, int nFlags, OpenedFile *pFile);
     void ReadLink(uint32_t lin, char *pBuf, size_t cbSize);
-    //uint32_t MkDir(FileStat &vStat, uint32_t linPar, const char *pszName);
-    void MkDir(uint32_t linPar, const char *pszName);
+    uint32_t MkDir(FileStat &vStat, uint32_t linPar, const char *pszName);
     void Unlink(uint32_t linPar, const char *pszName);
     void RmDir(uint32_t linPar, const char *pszName);
-    //uint32_t SymLink(FileStat &vStat, const char *pszLink, uint32_t linPar, const char *pszName);
-    void SymLink(const char *pszLink, uint32_t linPar, const char *pszName);
+    uint32_t SymLink(FileStat &vStat, const char *pszLink, uint32_t linPar, const char *pszName);
     void Rename(
         uint32_t linPar, const char *pszName,
         uint32_t linNewPar, const char *pszNewName,
         unsigned uFlags
     );
-    //void Link(FileStat &vStat, uint32_t lin, uint32_t linNewPar, const char *pszNewName);
-    void Link(uint32_t lin, uint32_t linNewPar, const char *pszNewName);
+    void Link(FileStat &vStat, uint32_t lin, uint32_t linNewPar, const char *pszNewName);
     void Truncate(uint32_t lin, off_t cbNewSize);
     OpenedFile *Open(uint32_t lin, fuse_file_info *pInfo);
     uint64_t Read(OpenedFile *pFile, void *pBuf, uint64_t cbSize, uint64_t cbOff);
     uint64_t Write(OpenedFile *pFile, const void *pBuf, uint64_t cbSize, uint64_t cbOff);
+    // ENOSPC if buffered data of the file could not be placed, it stays buffered
+    void Flush(OpenedFile *pFile);
     void Release(OpenedFile *pFile) noexcept;
-    void FSync(OpenedFile *pFile) noexcept;
+    void FSync(OpenedFile *pFile);
     OpenedDir *OpenDir(uint32_t lin);
-    void ReadDir(OpenedDir *pDir, void *pBuf, fuse_fill_dir_t fnFill, off_t vOff);
-    void ReleaseDir(OpenedDir *pDir) noexcept;
+    void ReadDir(OpenedDir *pDir, const FnFillDir &fnFill, off_t vOff);
+    // full attributes, the entries taken by fnFill count as looked up
+    void ReadDirPlus(OpenedDir *pDir, const FnFillDir &fnFill, off_t vOff);
+    void ReleaseDir(OpenedDir *pDir);
     void StatFs(VfsStat &vStat) const noexcept;
-    //std::pair<uint32_t, OpenedFile *> Create(FileStat &vStat, uint32_t linPar, const char *pszName);
-    OpenedFile *Create(uint32_t linPar, const char *pszName);
+    std::pair<uint32_t, OpenedFile *> Create(FileStat &vStat, uint32_t linPar, const char *pszName);
+    // whole clusters are shared (copy-on-write) when both offsets agree within a cluster
+    // returns count of bytes copied
+    uint64_t CopyFileRange(
+        OpenedFile *pIn, uint64_t cbOffIn,
+        OpenedFile *pOut, uint64_t cbOffOut,
+        uint64_t cbSize
+    );
+    // looked up inodes whose attributes changed outside any request on them, cleared on return
+    // clusters are allocated, compressed and trimmed when the delay buffer is flushed and on release
+    std::vector<uint32_t> TakeStale();
 
 public:
     // get count of free cluster
-    uint32_t AvailClu() const noexcept;
+    Lcn AvailClu() const noexcept;
 
 private:
+    // the inode table stays mapped, the pointer is valid as long as the Xxfs
     Inode *X_GetInode(uint32_t lin) noexcept;
+    // compaction moves entries and breaks the offsets of open handles
+    // it is deferred until the last handle of the directory is released
+    void X_DirShrink(OpenedDir &vDir);
+    // look up through the path cache and the name filter, vPolicy is either kAny or kDir
+    // {0, 0} if not exist
+    std::pair<uint32_t, uint16_t> X_Lookup(uint32_t linPar, std::string_view svName, DirPolicy vPolicy);
+    // fill the name filter of the directory from its entries
+    void X_FilterBuild(uint32_t linPar);
+    // zero the data past cbNewSize that a shrink keeps, so that it reads as zeros once the file grows
+    void X_ZeroTail(uint32_t lin, Inode *pi, uint64_t cbNewSize);
+    // copy through a buffer, returns count of bytes copied
+    uint64_t X_CopyBytes(
+        OpenedFile *pIn, uint64_t cbOffIn,
+        OpenedFile *pOut, uint64_t cbOffOut,
+        uint64_t cbSize
+    );
 
 private:
-    // allocate a free cluster and update meta cluster
-    ShrPtr<InodeCluster> Y_MapInoClu(uint32_t vcn) noexcept;
-    uint32_t Y_AllocIno();
-    // invoked when both lookup count and link count are 0
+    // allocate a free inode for a child of linPar and update meta cluster
+    uint32_t Y_AllocIno(uint32_t linPar, bool bDir);
+    // where the inode of a new child of linPar is searched from
+    // children go to the inode cluster of the parent so that a directory scan touches few inode clusters
+    // directories move to another group when the parent's runs short, top level ones are spread (Orlov)
+    uint32_t Y_InoGoal(uint32_t linPar, bool bDir) noexcept;
+    // drop a link, the inode is freed once both lookup count and link count are 0
     void Y_UnlinkIno(uint32_t lin, Inode *pi) noexcept;
+    void Y_FreeIno(uint32_t lin, Inode *pi) noexcept;
     // noexcept, assume mmap does not fail
     template<class tObj>
-    inline ShrPtr<tObj> Y_Map(uint32_t lcn) noexcept {
+    inline ShrPtr<tObj> Y_Map(Lcn lcn) noexcept {
         return x_vCluCache.At<tObj>(lcn);
     }
 
-    inline void Y_Touch(uint32_t lcn) noexcept {
+    inline void Y_Touch(Lcn lcn) noexcept {
         x_vCluCache.Touch(lcn);
     }
 
 private:
     // allocate a free cluster and update inode if lin is 0
-    // invokes Y_AllocClu
+    // lcnHint is tried first so that consecutive vcns land on consecutive lcns
+    // without a hint the cluster goes to the group of the inode
     template<class tObj>
-    inline ShrPtr<tObj> Y_FileAllocClu(Inode *pi, uint32_t &lcn) {
-        if (x_spcMeta->ccUsed >= x_spcMeta->ccTotal)
+    inline ShrPtr<tObj> Y_FileAllocClu(Inode *pi, Lcn &lcn, Lcn lcnHint = 0) {
+        if (x_spcMeta->ccUsed + x_ccDelayed >= x_spcMeta->ccTotal)
             throw Exception {ENOSPC};
-        lcn = x_vCluAlloc.Alloc();
+        lcn = x_vCluAlloc.Alloc(lcnHint ? lcnHint : Y_CluGoal(pi));
         ++x_spcMeta->ccUsed;
         ++pi->ccSize;
         auto &&spc = Y_Map<tObj>(lcn);
         memset(spc.get(), 0, kcbCluSize);
         return std::move(spc);
     }
+    // the first lcn of the cluster group that goes with the inode group of pi
+    inline Lcn Y_CluGoal(const Inode *pi) const noexcept {
+        return x_vCluAlloc.GroupStart(x_vInoAlloc.GroupOf((uint32_t) (pi - x_upInos.get())));
+    }
+    // speculative preallocation: the start of a run of cc free lcns from lcnHint on, set aside for a handle
+    // nothing is allocated, the run only keeps the windows of other handles off it
+    Lcn Y_Reserve(Lcn lcnHint, uint32_t cc);
+    void Y_Unreserve(Lcn lcn) noexcept;
+    // copy a shared cluster to a new one and drop the reference to the shared one
+    ShrPtr<void> Y_FileCowClu(Inode *pi, Lcn &lcn, Lcn lcnHint);
+    // locate the slot holding the lcn of vcn, allocate index clusters if bAlloc
+    // spc keeps the index cluster holding the slot mapped
+    Lcn *Y_FileSlot(Inode *pi, uint32_t vcn, bool bAlloc, ShrPtr<IndexCluster> &spc);
+    // make vcns of piOut refer to the clusters of vcns of piIn
+    // stops at a compressed unit, returns count of clusters shared
+    uint32_t Y_FileShare(Inode *piIn, uint32_t vcnIn, Inode *piOut, uint32_t vcnOut, uint32_t cc);
     // only used in shrink
     // check if each lcn is 0, do not double free
-    void Y_FileFreeClu(Inode *pi, uint32_t &lcn) noexcept;
-    void Y_FileFreeIdx1(Inode *pi, uint32_t &lcn, uint32_t vcnFrom = 0) noexcept;
-    void Y_FileFreeIdx2(Inode *pi, uint32_t &lcn, uint32_t vcnFrom = 0) noexcept;
-    void Y_FileFreeIdx3(Inode *pi, uint32_t &lcn, uint32_t vcnFrom = 0) noexcept;
+    // a shared cluster only loses a reference
+    void Y_FileFreeClu(Inode *pi, Lcn &lcn) noexcept;
+    // drop a reference of lcn, free it when no reference is left
+    void Y_CluRelease(Lcn lcn) noexcept;
+    void Y_FileFreeIdx1(Inode *pi, Lcn &lcn, uint32_t vcnFrom = 0) noexcept;
+    void Y_FileFreeIdx2(Inode *pi, Lcn &lcn, uint32_t vcnFrom = 0) noexcept;
+    void Y_FileFreeIdx3(Inode *pi, Lcn &lcn, uint32_t vcnFrom = 0) noexcept;
     // invoked when fsync and close
     void Y_FileShrink(Inode *pi) noexcept;
 
+private:
+    // delayed allocation: data written into holes of regular files is buffered here
+    // space is reserved by x_ccDelayed, lcns are picked in runs when flushed
+    // the buffered cluster of vcn, nullptr if vcn is not buffered
+    ByteCluster *Y_DelayGet(uint32_t lin, uint32_t vcn) noexcept;
+    // buffer a zeroed cluster for a hole, nullptr if the free space is too low
+    ByteCluster *Y_DelayNew(uint32_t lin, uint32_t vcn);
+    // allocate and write every buffered cluster of the file
+    // the runs go to the preallocated window of pFile if given
+    // returns false if the space ran out, the clusters not placed stay buffered
+    bool Y_DelayFlush(uint32_t lin, const OpenedFile *pFile = nullptr) noexcept;
+    bool Y_DelayFlushAll() noexcept;
+    // clusters written by flushes go through their own pointers, so fsync of a handle misses them
+    // note lcn as written for lin, until the file is fsynced
+    void Y_DelayWritten(uint32_t lin, Lcn lcn);
+    // msync the clusters the flushes wrote for lin
+    void Y_DelaySync(uint32_t lin) noexcept;
+    // discard buffered clusters from vcnFrom on
+    void Y_DelayDrop(uint32_t lin, uint32_t vcnFrom = 0) noexcept;
+
+private:
+    // check if the slot pLcn of vcn lies in a compressed unit
+    static inline bool Y_IsCmp(const Lcn *pLcn, uint32_t vcn) noexcept {
+        return pLcn[kccCmpUnit - 1 - vcn % kccCmpUnit] == kLcnCmp;
+    }
+    // the idx-th decompressed cluster of the unit whose slots start at pUnit
+    ShrPtr<void> Y_CmpMap(const Lcn *pUnit, uint32_t idx) noexcept;
+    // turn a compressed unit back into plain clusters
+    void Y_CmpExpand(Inode *pi, Lcn *pUnit);
+    // compress the buffered unit at the beginning of mapClus
+    // returns false and leaves mapClus alone if the unit is stored plain, and when it throws
+    bool Y_CmpStore(uint32_t lin, Inode *pi, std::map<uint32_t, std::unique_ptr<ByteCluster>> &mapClus);
+
+private:
+    // an indexed cluster identical to pc, 0 if none
+    Lcn Y_DedupFind(const ByteCluster *pc, uint64_t uHash) noexcept;
+    // index a freshly written data cluster, best effort
+    void Y_DedupAdd(uint64_t uHash, Lcn lcn) noexcept;
+    // remove lcn from the index, returns false if it is not indexed
+    bool Y_DedupDrop(Lcn lcn) noexcept;
+
+private:
+    // extra references of a cluster, 0 if not shared
+    uint32_t Y_RefGet(Lcn lcn) noexcept;
+    void Y_RefInc(Lcn lcn);
+    // returns false if the cluster was not shared
+    bool Y_RefDec(Lcn lcn) noexcept;
+
+private:
+    // rebuilds the byte tries of a version 0 image as radix tries
+    void X_UpgradeDirs();
+    // the names of a version 0 directory with their inode numbers and modes
+    std::vector<std::tuple<std::string, uint32_t, uint16_t>> X_ListV0(Inode *pi);
+
+private:
+    // write the buffered cluster pc to vcn, or refer to an identical cluster
+    // returns the lcn written, 0 if vcn refers to an identical cluster
+    Lcn X_DelayPlace(Inode *pi, FilePtrW &fp, uint32_t vcn, const ByteCluster *pc);
+    ShrPtr<CmpUnit> X_CmpLoad(const Lcn *pUnit) noexcept;
+    inline uint32_t X_DedupBucket(uint64_t uHash) const noexcept {
+        return (uint32_t) (uHash % std::max<Lcn>(x_spcMeta->ccTotal / kcdePerClu, 1));
+    }
+    // drop the decompressed unit stored from lcn
+    inline void X_CmpForget(Lcn lcn) noexcept {
+        auto &vEnt = x_aCmpCache[lcn % kcCmpCache];
+        if (vEnt.first == lcn)
+            vEnt = {0, nullptr};
+    }
+
 private:
     constexpr static void X_FillStat(FileStat &vStat, uint32_t lin, Inode *pNod) noexcept;
 
@@ -111,12 +251,41 @@ private:
     RaiiFile x_vRf;
     ShrPtr<MetaCluster> x_spcMeta;
     ClusterCache<256> x_vCluCache;
-    ClusterCache<64> x_vInoCluCache;
+    RunPtr<Inode> x_upInos;
+    PathCache x_vPathCache;
+    NameFilter x_vNameFilter;
+    InodeCache x_vInoCache;
+    HandlePool<OpenedFile> x_vFilePool;
+    HandlePool<OpenedDir> x_vDirPool;
+    // one allocation group per cluster of the cluster bitmap, the i-th inode group goes with the i-th cluster group
     BitmapAllocator x_vCluAlloc;
     BitmapAllocator x_vInoAlloc;
+    FilePtrR x_fpRefR;
+    FilePtrW x_fpRefW;
+    FilePtrR x_fpDedupR;
+    FilePtrW x_fpDedupW;
+    std::unordered_map<uint32_t, std::map<uint32_t, std::unique_ptr<ByteCluster>>> x_mapDelayed;
+    uint32_t x_ccDelayed = 0;
+    // runs of clusters written by flushes and not synced yet, first lcn and count
+    std::unordered_map<uint32_t, std::vector<std::pair<Lcn, uint32_t>>> x_mapUnsynced;
+    // the windows set aside for handles, first lcn to the end
+    std::map<Lcn, Lcn> x_mapResv;
+    // the group tried first for the next top level directory
+    uint32_t x_vGrpDir = 0;
+    std::vector<uint32_t> x_vecStale;
+    // count of open handles of each directory
+    std::unordered_map<uint32_t, uint32_t> x_mapDirOpen;
+    // bumped whenever a mapped lcn of a file changes without the file shrinking
+    // invalidates the cached cluster of every FilePointer
+    uint32_t x_uShareGen = 0;
+    bool x_bCompress;
+    bool x_bDedup;
+    // recently decompressed units, direct mapped by the first lcn of the unit
+    constexpr static uint32_t kcCmpCache = 16;
+    std::pair<Lcn, ShrPtr<CmpUnit>> x_aCmpCache[kcCmpCache];
     
 };
 
-}
+}}
 
 #endif
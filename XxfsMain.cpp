@@ -3,12 +3,33 @@
 #include "Raii.hpp"
 #include "Xxfs.hpp"
 
-namespace xxfs { namespace {
+namespace xxfs {
+
+// the entries of the builds for every cluster size and lcn width
+#define X_ENTRY(s_, b_) namespace XXFS_BUILD_NS(s_, b_) { int XxfsMain(int ncArg, char *ppszArgs[]); }
+XXFS_BUILDS(X_ENTRY)
+#undef X_ENTRY
+
+inline namespace XXFS_CLU_NS { namespace {
 
 bool f_bVerbose = false;
+bool f_bWriteback = false;
+
+// nothing but this process changes the filesystem
+// what changes behind the kernel is invalidated after each request
+constexpr double kTimeout = 86400.0;
+
+// the kernel numbers the root FUSE_ROOT_ID, inode numbers are shifted by it
+constexpr fuse_ino_t ToIno(uint32_t lin) noexcept {
+    return (fuse_ino_t) lin + FUSE_ROOT_ID;
+}
 
-inline Xxfs *GetXxfs() noexcept {
-    return (Xxfs *) fuse_get_context()->private_data;
+constexpr uint32_t ToLin(fuse_ino_t vIno) noexcept {
+    return (uint32_t) (vIno - FUSE_ROOT_ID);
+}
+
+inline Xxfs *GetXxfs(fuse_req_t pReq) noexcept {
+    return (Xxfs *) fuse_req_userdata(pReq);
 }
 
 inline void PutHandle(fuse_file_info *pInfo, OpenedFile *pFile) {
@@ -39,23 +60,49 @@ constexpr OpenedDir *GetDir(fuse_file_info *pInfo) {
     return static_cast<OpenedDir *>(pFile);
 }
 
-int XxfsGetAttr(const char *pszPath, FileStat *pStat, fuse_file_info *pInfo) {
+inline void FixIno(FileStat &vStat) noexcept {
+    vStat.st_ino = ToIno((uint32_t) vStat.st_ino);
+}
+
+inline fuse_entry_param MakeEntry(uint32_t lin, FileStat &vStat) noexcept {
+    fuse_entry_param vEnt {};
+    FixIno(vStat);
+    vEnt.ino = ToIno(lin);
+    vEnt.attr = vStat;
+    vEnt.attr_timeout = kTimeout;
+    vEnt.entry_timeout = kTimeout;
+    return vEnt;
+}
+
+// with writeback cache the kernel appends by itself and may read back partial pages through any handle
+inline void FixOpen(fuse_file_info *pInfo) noexcept {
+    if (f_bWriteback) {
+        if ((pInfo->flags & O_ACCMODE) == O_WRONLY)
+            pInfo->flags = (pInfo->flags & ~O_ACCMODE) | O_RDWR;
+        pInfo->flags &= ~O_APPEND;
+    }
+}
+
+void XxfsLookup(fuse_req_t pReq, fuse_ino_t vInoPar, const char *pszName) {
     if (f_bVerbose)
-        printf("%s(%s)\n", __func__, pszPath);
+        printf("%s(%lu, %s)\n", __func__, (unsigned long) vInoPar, pszName);
     try {
-        auto pFile = GetFile(pInfo);
-        if (pFile) {
-            FillStat(*pStat, pFile->lin, pFile->pi);
-            return 0;
+        auto px = GetXxfs(pReq);
+        FileStat vStat;
+        auto lin = px->Lookup(vStat, ToLin(vInoPar), pszName);
+        if (!lin) {
+            // a negative entry, which the kernel caches as well
+            fuse_entry_param vEnt {};
+            vEnt.entry_timeout = kTimeout;
+            fuse_reply_entry(pReq, &vEnt);
+            return;
         }
-        auto px = GetXxfs();
-        auto lin = px->LinAt(pszPath);
-        px->GetAttr(*pStat, lin);
-        return 0;
+        auto vEnt = MakeEntry(lin, vStat);
+        fuse_reply_entry(pReq, &vEnt);
     }
     catch (Exception &e) {
         fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
-        return -e.nErrno;
+        fuse_reply_err(pReq, e.nErrno);
     }
     catch (FatalException &e) {
         fprintf(stderr, "%s failed: ", __func__);
@@ -64,18 +111,38 @@ int XxfsGetAttr(const char *pszPath, FileStat *pStat, fuse_file_info *pInfo) {
     }
 }
 
-int XxfsReadLink(const char *pszPath, char *pBuf, size_t cbSize) {
+void XxfsForget(fuse_req_t pReq, fuse_ino_t vIno, uint64_t cLookup) {
+    if (f_bVerbose)
+        printf("%s(%lu)\n", __func__, (unsigned long) vIno);
+    GetXxfs(pReq)->Forget(ToLin(vIno), cLookup);
+    fuse_reply_none(pReq);
+}
+
+void XxfsForgetMulti(fuse_req_t pReq, size_t cForget, fuse_forget_data *pForgets) {
+    if (f_bVerbose)
+        printf("%s(%zu)\n", __func__, cForget);
+    auto px = GetXxfs(pReq);
+    for (size_t i = 0; i < cForget; ++i)
+        px->Forget(ToLin(pForgets[i].ino), pForgets[i].nlookup);
+    fuse_reply_none(pReq);
+}
+
+void XxfsGetAttr(fuse_req_t pReq, fuse_ino_t vIno, fuse_file_info *pInfo) {
     if (f_bVerbose)
-        printf("%s(%s)\n", __func__, pszPath);
+        printf("%s(%lu)\n", __func__, (unsigned long) vIno);
     try {
-        auto px = GetXxfs();
-        auto lin = px->LinAt(pszPath);
-        px->ReadLink(lin, pBuf, cbSize);
-        return 0;
+        FileStat vStat;
+        auto pFile = GetFile(pInfo);
+        if (pFile)
+            FillStat(vStat, pFile->lin, pFile->pi);
+        else
+            GetXxfs(pReq)->GetAttr(vStat, ToLin(vIno));
+        FixIno(vStat);
+        fuse_reply_attr(pReq, &vStat, kTimeout);
     }
     catch (Exception &e) {
         fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
-        return -e.nErrno;
+        fuse_reply_err(pReq, e.nErrno);
     }
     catch (FatalException &e) {
         fprintf(stderr, "%s failed: ", __func__);
@@ -84,18 +151,19 @@ int XxfsReadLink(const char *pszPath, char *pBuf, size_t cbSize) {
     }
 }
 
-int XxfsMkDir(const char *pszPath, mode_t) {
+void XxfsSetAttr(fuse_req_t pReq, fuse_ino_t vIno, FileStat *pStat, int nFlags, fuse_file_info *pInfo) {
     if (f_bVerbose)
-        printf("%s(%s)\n", __func__, pszPath);
+        printf("%s(%lu)\n", __func__, (unsigned long) vIno);
     try {
-        auto px = GetXxfs();
-        auto linPar = px->LinPar(pszPath);
-        px->MkDir(linPar, pszPath);
-        return 0;
+        auto px = GetXxfs(pReq);
+        FileStat vStat;
+        px->SetAttr(vStat, ToLin(vIno), *pStat, nFlags, GetNdir(pInfo));
+        FixIno(vStat);
+        fuse_reply_attr(pReq, &vStat, kTimeout);
     }
     catch (Exception &e) {
         fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
-        return -e.nErrno;
+        fuse_reply_err(pReq, e.nErrno);
     }
     catch (FatalException &e) {
         fprintf(stderr, "%s failed: ", __func__);
@@ -104,18 +172,18 @@ int XxfsMkDir(const char *pszPath, mode_t) {
     }
 }
 
-int XxfsUnlink(const char *pszPath) {
+void XxfsReadLink(fuse_req_t pReq, fuse_ino_t vIno) {
     if (f_bVerbose)
-        printf("%s(%s)\n", __func__, pszPath);
+        printf("%s(%lu)\n", __func__, (unsigned long) vIno);
     try {
-        auto px = GetXxfs();
-        auto linPar = px->LinPar(pszPath);
-        px->Unlink(linPar, pszPath);
-        return 0;
+        auto px = GetXxfs(pReq);
+        char szLink[kcbCluSize];
+        px->ReadLink(ToLin(vIno), szLink, sizeof(szLink));
+        fuse_reply_readlink(pReq, szLink);
     }
     catch (Exception &e) {
         fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
-        return -e.nErrno;
+        fuse_reply_err(pReq, e.nErrno);
     }
     catch (FatalException &e) {
         fprintf(stderr, "%s failed: ", __func__);
@@ -124,18 +192,19 @@ int XxfsUnlink(const char *pszPath) {
     }
 }
 
-int XxfsRmDir(const char *pszPath) {
+void XxfsMkDir(fuse_req_t pReq, fuse_ino_t vInoPar, const char *pszName, mode_t) {
     if (f_bVerbose)
-        printf("%s(%s)\n", __func__, pszPath);
+        printf("%s(%lu, %s)\n", __func__, (unsigned long) vInoPar, pszName);
     try {
-        auto px = GetXxfs();
-        auto linPar = px->LinPar(pszPath);
-        px->RmDir(linPar, pszPath);
-        return 0;
+        auto px = GetXxfs(pReq);
+        FileStat vStat;
+        auto lin = px->MkDir(vStat, ToLin(vInoPar), pszName);
+        auto vEnt = MakeEntry(lin, vStat);
+        fuse_reply_entry(pReq, &vEnt);
     }
     catch (Exception &e) {
         fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
-        return -e.nErrno;
+        fuse_reply_err(pReq, e.nErrno);
     }
     catch (FatalException &e) {
         fprintf(stderr, "%s failed: ", __func__);
@@ -144,18 +213,17 @@ int XxfsRmDir(const char *pszPath) {
     }
 }
 
-int XxfsSymLink(const char *pszLink, const char *pszPath) {
+void XxfsUnlink(fuse_req_t pReq, fuse_ino_t vInoPar, const char *pszName) {
     if (f_bVerbose)
-        printf("%s(%s)\n", __func__, pszPath);
+        printf("%s(%lu, %s)\n", __func__, (unsigned long) vInoPar, pszName);
     try {
-        auto px = GetXxfs();
-        auto linPar = px->LinPar(pszPath);
-        px->SymLink(pszLink, linPar, pszPath);
-        return 0;
+        auto px = GetXxfs(pReq);
+        px->Unlink(ToLin(vInoPar), pszName);
+        fuse_reply_err(pReq, 0);
     }
     catch (Exception &e) {
         fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
-        return -e.nErrno;
+        fuse_reply_err(pReq, e.nErrno);
     }
     catch (FatalException &e) {
         fprintf(stderr, "%s failed: ", __func__);
@@ -164,19 +232,17 @@ int XxfsSymLink(const char *pszLink, const char *pszPath) {
     }
 }
 
-int XxfsRename(const char *pszPath, const char *pszNewPath, unsigned uFlags) {
+void XxfsRmDir(fuse_req_t pReq, fuse_ino_t vInoPar, const char *pszName) {
     if (f_bVerbose)
-        printf("%s(%s)\n", __func__, pszPath);
+        printf("%s(%lu, %s)\n", __func__, (unsigned long) vInoPar, pszName);
     try {
-        auto px = GetXxfs();
-        auto linPar = px->LinPar(pszPath);
-        auto linNewPar = px->LinPar(pszNewPath);
-        px->Rename(linPar, pszPath, linNewPar, pszNewPath, uFlags);
-        return 0;
+        auto px = GetXxfs(pReq);
+        px->RmDir(ToLin(vInoPar), pszName);
+        fuse_reply_err(pReq, 0);
     }
     catch (Exception &e) {
         fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
-        return -e.nErrno;
+        fuse_reply_err(pReq, e.nErrno);
     }
     catch (FatalException &e) {
         fprintf(stderr, "%s failed: ", __func__);
@@ -185,19 +251,19 @@ int XxfsRename(const char *pszPath, const char *pszNewPath, unsigned uFlags) {
     }
 }
 
-int XxfsLink(const char *pszPath, const char *pszNewPath) {
+void XxfsSymLink(fuse_req_t pReq, const char *pszLink, fuse_ino_t vInoPar, const char *pszName) {
     if (f_bVerbose)
-        printf("%s(%s)\n", __func__, pszPath);
+        printf("%s(%lu, %s)\n", __func__, (unsigned long) vInoPar, pszName);
     try {
-        auto px = GetXxfs();
-        auto lin = px->LinAt(pszPath);
-        auto linNewPar = px->LinPar(pszNewPath);
-        px->Link(lin, linNewPar, pszNewPath);
-        return 0;
+        auto px = GetXxfs(pReq);
+        FileStat vStat;
+        auto lin = px->SymLink(vStat, pszLink, ToLin(vInoPar), pszName);
+        auto vEnt = MakeEntry(lin, vStat);
+        fuse_reply_entry(pReq, &vEnt);
     }
     catch (Exception &e) {
         fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
-        return -e.nErrno;
+        fuse_reply_err(pReq, e.nErrno);
     }
     catch (FatalException &e) {
         fprintf(stderr, "%s failed: ", __func__);
@@ -206,26 +272,20 @@ int XxfsLink(const char *pszPath, const char *pszNewPath) {
     }
 }
 
-// TODO: move part of the code into Xxfs
-int XxfsTruncate(const char *pszPath, off_t cbNewSize, fuse_file_info *pInfo) {
+void XxfsRename(
+    fuse_req_t pReq, fuse_ino_t vInoPar, const char *pszName,
+    fuse_ino_t vInoNewPar, const char *pszNewName, unsigned uFlags
+) {
     if (f_bVerbose)
-        printf("%s(%s)\n", __func__, pszPath);
+        printf("%s(%lu, %s)\n", __func__, (unsigned long) vInoPar, pszName);
     try {
-        auto pFile = GetNdir(pInfo);
-        if (pFile) {
-            if ((size_t) cbNewSize >= kcbMaxSize)
-                throw Exception {EINVAL};
-            pFile->pi->cbSize = (uint64_t) cbNewSize;
-            return 0;
-        }
-        auto px = GetXxfs();
-        auto lin = px->LinAt(pszPath);
-        px->Truncate(lin, cbNewSize);
-        return 0;
+        auto px = GetXxfs(pReq);
+        px->Rename(ToLin(vInoPar), pszName, ToLin(vInoNewPar), pszNewName, uFlags);
+        fuse_reply_err(pReq, 0);
     }
     catch (Exception &e) {
         fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
-        return -e.nErrno;
+        fuse_reply_err(pReq, e.nErrno);
     }
     catch (FatalException &e) {
         fprintf(stderr, "%s failed: ", __func__);
@@ -234,18 +294,20 @@ int XxfsTruncate(const char *pszPath, off_t cbNewSize, fuse_file_info *pInfo) {
     }
 }
 
-int XxfsOpen(const char *pszPath, fuse_file_info *pInfo) {
+void XxfsLink(fuse_req_t pReq, fuse_ino_t vIno, fuse_ino_t vInoNewPar, const char *pszNewName) {
     if (f_bVerbose)
-        printf("%s(%s)\n", __func__, pszPath);
+        printf("%s(%lu, %s)\n", __func__, (unsigned long) vInoNewPar, pszNewName);
     try {
-        auto px = GetXxfs();
-        auto lin = px->LinAt(pszPath);
-        PutHandle(pInfo, px->Open(lin, pInfo));
-        return 0;
+        auto px = GetXxfs(pReq);
+        FileStat vStat;
+        auto lin = ToLin(vIno);
+        px->Link(vStat, lin, ToLin(vInoNewPar), pszNewName);
+        auto vEnt = MakeEntry(lin, vStat);
+        fuse_reply_entry(pReq, &vEnt);
     }
     catch (Exception &e) {
         fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
-        return -e.nErrno;
+        fuse_reply_err(pReq, e.nErrno);
     }
     catch (FatalException &e) {
         fprintf(stderr, "%s failed: ", __func__);
@@ -254,16 +316,19 @@ int XxfsOpen(const char *pszPath, fuse_file_info *pInfo) {
     }
 }
 
-int XxfsRead(const char *pszPath, char *pBuf, size_t cbSize, off_t cbOff, fuse_file_info *pInfo) {
+void XxfsOpen(fuse_req_t pReq, fuse_ino_t vIno, fuse_file_info *pInfo) {
     if (f_bVerbose)
-        printf("%s(%s)\n", __func__, pszPath);
+        printf("%s(%lu)\n", __func__, (unsigned long) vIno);
     try {
-        auto px = GetXxfs();
-        return (int) px->Read(GetNdir(pInfo), pBuf, (uint64_t) cbSize, (uint64_t) cbOff);
+        auto px = GetXxfs(pReq);
+        FixOpen(pInfo);
+        PutHandle(pInfo, px->Open(ToLin(vIno), pInfo));
+        pInfo->keep_cache = !pInfo->direct_io;
+        fuse_reply_open(pReq, pInfo);
     }
     catch (Exception &e) {
         fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
-        return -e.nErrno;
+        fuse_reply_err(pReq, e.nErrno);
     }
     catch (FatalException &e) {
         fprintf(stderr, "%s failed: ", __func__);
@@ -272,16 +337,18 @@ int XxfsRead(const char *pszPath, char *pBuf, size_t cbSize, off_t cbOff, fuse_f
     }
 }
 
-int XxfsWrite(const char *pszPath, const char *pBuf, size_t cbSize, off_t cbOff, fuse_file_info *pInfo) {
+void XxfsRead(fuse_req_t pReq, fuse_ino_t vIno, size_t cbSize, off_t cbOff, fuse_file_info *pInfo) {
     if (f_bVerbose)
-        printf("%s(%s)\n", __func__, pszPath);
+        printf("%s(%lu)\n", __func__, (unsigned long) vIno);
     try {
-        auto px = GetXxfs();
-        return (int) px->Write(GetNdir(pInfo), pBuf, (uint64_t) cbSize, (uint64_t) cbOff);
+        auto px = GetXxfs(pReq);
+        auto upBuf = std::make_unique<char[]>(cbSize);
+        auto cbRead = px->Read(GetNdir(pInfo), upBuf.get(), (uint64_t) cbSize, (uint64_t) cbOff);
+        fuse_reply_buf(pReq, upBuf.get(), (size_t) cbRead);
     }
     catch (Exception &e) {
         fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
-        return -e.nErrno;
+        fuse_reply_err(pReq, e.nErrno);
     }
     catch (FatalException &e) {
         fprintf(stderr, "%s failed: ", __func__);
@@ -290,17 +357,59 @@ int XxfsWrite(const char *pszPath, const char *pBuf, size_t cbSize, off_t cbOff,
     }
 }
 
-int XxfsStatFs(const char *pszPath, VfsStat *pStat) {
+void XxfsWrite(
+    fuse_req_t pReq, fuse_ino_t vIno, const char *pBuf,
+    size_t cbSize, off_t cbOff, fuse_file_info *pInfo
+) {
     if (f_bVerbose)
-        printf("%s(%s)\n", __func__, pszPath);
+        printf("%s(%lu)\n", __func__, (unsigned long) vIno);
     try {
-        auto px = GetXxfs();
-        px->StatFs(*pStat);
-        return 0;
+        auto px = GetXxfs(pReq);
+        auto cbWritten = px->Write(GetNdir(pInfo), pBuf, (uint64_t) cbSize, (uint64_t) cbOff);
+        fuse_reply_write(pReq, (size_t) cbWritten);
+    }
+    catch (Exception &e) {
+        fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
+        fuse_reply_err(pReq, e.nErrno);
+    }
+    catch (FatalException &e) {
+        fprintf(stderr, "%s failed: ", __func__);
+        e.ShowWhat(stderr);
+        exit(-1);
+    }
+}
+
+void XxfsStatFs(fuse_req_t pReq, fuse_ino_t vIno) {
+    if (f_bVerbose)
+        printf("%s(%lu)\n", __func__, (unsigned long) vIno);
+    try {
+        auto px = GetXxfs(pReq);
+        VfsStat vStat;
+        px->StatFs(vStat);
+        fuse_reply_statfs(pReq, &vStat);
+    }
+    catch (Exception &e) {
+        fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
+        fuse_reply_err(pReq, e.nErrno);
+    }
+    catch (FatalException &e) {
+        fprintf(stderr, "%s failed: ", __func__);
+        e.ShowWhat(stderr);
+        exit(-1);
+    }
+}
+
+void XxfsFlush(fuse_req_t pReq, fuse_ino_t vIno, fuse_file_info *pInfo) {
+    if (f_bVerbose)
+        printf("%s(%lu)\n", __func__, (unsigned long) vIno);
+    try {
+        auto px = GetXxfs(pReq);
+        px->Flush(GetNdir(pInfo));
+        fuse_reply_err(pReq, 0);
     }
     catch (Exception &e) {
         fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
-        return -e.nErrno;
+        fuse_reply_err(pReq, e.nErrno);
     }
     catch (FatalException &e) {
         fprintf(stderr, "%s failed: ", __func__);
@@ -309,17 +418,17 @@ int XxfsStatFs(const char *pszPath, VfsStat *pStat) {
     }
 }
 
-int XxfsRelease(const char *pszPath, fuse_file_info *pInfo) {
+void XxfsRelease(fuse_req_t pReq, fuse_ino_t vIno, fuse_file_info *pInfo) {
     if (f_bVerbose)
-        printf("%s(%s)\n", __func__, pszPath);
+        printf("%s(%lu)\n", __func__, (unsigned long) vIno);
     try {
-        auto px = GetXxfs();
+        auto px = GetXxfs(pReq);
         px->Release(GetNdir(pInfo));
-        return 0;
+        fuse_reply_err(pReq, 0);
     }
     catch (Exception &e) {
         fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
-        return -e.nErrno;
+        fuse_reply_err(pReq, e.nErrno);
     }
     catch (FatalException &e) {
         fprintf(stderr, "%s failed: ", __func__);
@@ -328,17 +437,17 @@ int XxfsRelease(const char *pszPath, fuse_file_info *pInfo) {
     }
 }
 
-int XxfsFSync(const char *pszPath, int, fuse_file_info *pInfo) {
+void XxfsFSync(fuse_req_t pReq, fuse_ino_t vIno, int, fuse_file_info *pInfo) {
     if (f_bVerbose)
-        printf("%s(%s)\n", __func__, pszPath);
+        printf("%s(%lu)\n", __func__, (unsigned long) vIno);
     try {
-        auto px = GetXxfs();
+        auto px = GetXxfs(pReq);
         px->FSync(GetNdir(pInfo));
-        return 0;
+        fuse_reply_err(pReq, 0);
     }
     catch (Exception &e) {
         fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
-        return -e.nErrno;
+        fuse_reply_err(pReq, e.nErrno);
     }
     catch (FatalException &e) {
         fprintf(stderr, "%s failed: ", __func__);
@@ -347,18 +456,17 @@ int XxfsFSync(const char *pszPath, int, fuse_file_info *pInfo) {
     }
 }
 
-int XxfsOpenDir(const char *pszPath, fuse_file_info *pInfo) {
+void XxfsOpenDir(fuse_req_t pReq, fuse_ino_t vIno, fuse_file_info *pInfo) {
     if (f_bVerbose)
-        printf("%s(%s)\n", __func__, pszPath);
+        printf("%s(%lu)\n", __func__, (unsigned long) vIno);
     try {
-        auto px = GetXxfs();
-        auto lin = px->LinAt(pszPath);
-        PutHandle(pInfo, px->OpenDir(lin));
-        return 0;
+        auto px = GetXxfs(pReq);
+        PutHandle(pInfo, px->OpenDir(ToLin(vIno)));
+        fuse_reply_open(pReq, pInfo);
     }
     catch (Exception &e) {
         fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
-        return -e.nErrno;
+        fuse_reply_err(pReq, e.nErrno);
     }
     catch (FatalException &e) {
         fprintf(stderr, "%s failed: ", __func__);
@@ -367,20 +475,60 @@ int XxfsOpenDir(const char *pszPath, fuse_file_info *pInfo) {
     }
 }
 
-int XxfsReadDir(
-    const char *pszPath, void *pBuf, fuse_fill_dir_t fnFill,
-    off_t vOff, fuse_file_info *pInfo, fuse_readdir_flags
-) {
+void XxfsReadDir(fuse_req_t pReq, fuse_ino_t vIno, size_t cbSize, off_t vOff, fuse_file_info *pInfo) {
     if (f_bVerbose)
-        printf("%s(%s)\n", __func__, pszPath);
+        printf("%s(%lu)\n", __func__, (unsigned long) vIno);
     try {
-        auto px = GetXxfs();
-        px->ReadDir(GetDir(pInfo), pBuf, fnFill, vOff);
-        return 0;
+        auto px = GetXxfs(pReq);
+        auto upBuf = std::make_unique<char[]>(cbSize);
+        size_t cbUsed = 0;
+        px->ReadDir(GetDir(pInfo), [&] (const char *pszName, const FileStat &vStat, off_t vNextOff) {
+            FileStat vEntStat = vStat;
+            FixIno(vEntStat);
+            auto cbEnt = fuse_add_direntry(
+                pReq, upBuf.get() + cbUsed, cbSize - cbUsed, pszName, &vEntStat, vNextOff
+            );
+            if (cbEnt > cbSize - cbUsed)
+                return true;
+            cbUsed += cbEnt;
+            return false;
+        }, vOff);
+        fuse_reply_buf(pReq, upBuf.get(), cbUsed);
+    }
+    catch (Exception &e) {
+        fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
+        fuse_reply_err(pReq, e.nErrno);
+    }
+    catch (FatalException &e) {
+        fprintf(stderr, "%s failed: ", __func__);
+        e.ShowWhat(stderr);
+        exit(-1);
+    }
+}
+
+void XxfsReadDirPlus(fuse_req_t pReq, fuse_ino_t vIno, size_t cbSize, off_t vOff, fuse_file_info *pInfo) {
+    if (f_bVerbose)
+        printf("%s(%lu)\n", __func__, (unsigned long) vIno);
+    try {
+        auto px = GetXxfs(pReq);
+        auto upBuf = std::make_unique<char[]>(cbSize);
+        size_t cbUsed = 0;
+        px->ReadDirPlus(GetDir(pInfo), [&] (const char *pszName, const FileStat &vStat, off_t vNextOff) {
+            FileStat vEntStat = vStat;
+            auto vEnt = MakeEntry((uint32_t) vStat.st_ino, vEntStat);
+            auto cbEnt = fuse_add_direntry_plus(
+                pReq, upBuf.get() + cbUsed, cbSize - cbUsed, pszName, &vEnt, vNextOff
+            );
+            if (cbEnt > cbSize - cbUsed)
+                return true;
+            cbUsed += cbEnt;
+            return false;
+        }, vOff);
+        fuse_reply_buf(pReq, upBuf.get(), cbUsed);
     }
     catch (Exception &e) {
         fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
-        return -e.nErrno;
+        fuse_reply_err(pReq, e.nErrno);
     }
     catch (FatalException &e) {
         fprintf(stderr, "%s failed: ", __func__);
@@ -389,17 +537,17 @@ int XxfsReadDir(
     }
 }
 
-int XxfsReleaseDir(const char *pszPath, fuse_file_info *pInfo) {
+void XxfsReleaseDir(fuse_req_t pReq, fuse_ino_t vIno, fuse_file_info *pInfo) {
     if (f_bVerbose)
-        printf("%s(%s)\n", __func__, pszPath);
+        printf("%s(%lu)\n", __func__, (unsigned long) vIno);
     try {
-        auto px = GetXxfs();
+        auto px = GetXxfs(pReq);
         px->ReleaseDir(GetDir(pInfo));
-        return 0;
+        fuse_reply_err(pReq, 0);
     }
     catch (Exception &e) {
         fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
-        return -e.nErrno;
+        fuse_reply_err(pReq, e.nErrno);
     }
     catch (FatalException &e) {
         fprintf(stderr, "%s failed: ", __func__);
@@ -408,18 +556,50 @@ int XxfsReleaseDir(const char *pszPath, fuse_file_info *pInfo) {
     }
 }
 
-int XxfsCreate(const char *pszPath, mode_t, fuse_file_info *pInfo) {
+void XxfsCreate(fuse_req_t pReq, fuse_ino_t vInoPar, const char *pszName, mode_t, fuse_file_info *pInfo) {
     if (f_bVerbose)
-        printf("%s(%s)\n", __func__, pszPath);
+        printf("%s(%lu, %s)\n", __func__, (unsigned long) vInoPar, pszName);
     try {
-        auto px = GetXxfs();
-        auto linPar = px->LinPar(pszPath);
-        PutHandle(pInfo, px->Create(linPar, pszPath));
-        return 0;
+        auto px = GetXxfs(pReq);
+        FileStat vStat;
+        auto [lin, pFile] = px->Create(vStat, ToLin(vInoPar), pszName);
+        PutHandle(pInfo, pFile);
+        pInfo->keep_cache = true;
+        auto vEnt = MakeEntry(lin, vStat);
+        fuse_reply_create(pReq, &vEnt, pInfo);
+    }
+    catch (Exception &e) {
+        fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
+        fuse_reply_err(pReq, e.nErrno);
+    }
+    catch (FatalException &e) {
+        fprintf(stderr, "%s failed: ", __func__);
+        e.ShowWhat(stderr);
+        exit(-1);
+    }
+}
+
+void XxfsCopyFileRange(
+    fuse_req_t pReq, fuse_ino_t vInoIn, off_t cbOffIn, fuse_file_info *pInfoIn,
+    fuse_ino_t vInoOut, off_t cbOffOut, fuse_file_info *pInfoOut,
+    size_t cbSize, int nFlags
+) {
+    if (f_bVerbose)
+        printf("%s(%lu, %lu)\n", __func__, (unsigned long) vInoIn, (unsigned long) vInoOut);
+    try {
+        if (nFlags)
+            throw Exception {EINVAL};
+        auto px = GetXxfs(pReq);
+        auto cbCopied = px->CopyFileRange(
+            GetNdir(pInfoIn), (uint64_t) cbOffIn,
+            GetNdir(pInfoOut), (uint64_t) cbOffOut,
+            (uint64_t) cbSize
+        );
+        fuse_reply_write(pReq, (size_t) cbCopied);
     }
     catch (Exception &e) {
         fprintf(stderr, "%s failed: [%d] %s\n", __func__, e.nErrno, strerror(e.nErrno));
-        return -e.nErrno;
+        fuse_reply_err(pReq, e.nErrno);
     }
     catch (FatalException &e) {
         fprintf(stderr, "%s failed: ", __func__);
@@ -428,9 +608,30 @@ int XxfsCreate(const char *pszPath, mode_t, fuse_file_info *pInfo) {
     }
 }
 
-constexpr static fuse_operations XxfsOps() {
-    fuse_operations vOps {};
+void XxfsInit(void *, fuse_conn_info *pConn) {
+    if (f_bVerbose)
+        printf("%s()\n", __func__);
+    if (pConn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+        pConn->want |= FUSE_CAP_WRITEBACK_CACHE;
+        f_bWriteback = true;
+    }
+}
+
+// inodes unlinked while looked up are freed here
+void XxfsDestroy(void *pData) {
+    if (f_bVerbose)
+        printf("%s()\n", __func__);
+    ((Xxfs *) pData)->ForgetAll();
+}
+
+constexpr static fuse_lowlevel_ops XxfsOps() {
+    fuse_lowlevel_ops vOps {};
+    vOps.init = &XxfsInit;
+    vOps.destroy = &XxfsDestroy;
+    vOps.lookup = &XxfsLookup;
+    vOps.forget = &XxfsForget;
     vOps.getattr = &XxfsGetAttr;
+    vOps.setattr = &XxfsSetAttr;
     vOps.readlink = &XxfsReadLink;
     //  .mknod
     vOps.mkdir = &XxfsMkDir;
@@ -439,68 +640,113 @@ constexpr static fuse_operations XxfsOps() {
     vOps.symlink = &XxfsSymLink;
     vOps.rename = &XxfsRename;
     vOps.link = &XxfsLink;
-    //  .chmod
-    //  .chown
-    vOps.truncate = &XxfsTruncate;
     vOps.open = &XxfsOpen;
     vOps.read = &XxfsRead;
     vOps.write = &XxfsWrite;
-    vOps.statfs = &XxfsStatFs;
-    //  .flush
+    vOps.flush = &XxfsFlush;
     vOps.release = &XxfsRelease;
     vOps.fsync = &XxfsFSync;
-    //  .setxattr
-    //  .getxattr
-    //  .listxattr
-    //  .removexattr
     vOps.opendir = &XxfsOpenDir;
     vOps.readdir = &XxfsReadDir;
     vOps.releasedir = &XxfsReleaseDir;
     //  .fsyncdir
-    //  .init
-    //  .destroy
+    vOps.statfs = &XxfsStatFs;
+    //  .setxattr
+    //  .getxattr
+    //  .listxattr
+    //  .removexattr
     //  .access
     vOps.create = &XxfsCreate;
-    //  .lock
-    //  .utimens
+    //  .getlk
+    //  .setlk
     //  .bmap
     //  .ioctl
     //  .poll
     //  .write_buf
-    //  .read_buf
+    //  .retrieve_reply
+    vOps.forget_multi = &XxfsForgetMulti;
     //  .flock
     //  .fallocate
+    vOps.readdirplus = &XxfsReadDirPlus;
+    vOps.copy_file_range = &XxfsCopyFileRange;
+    //  .lseek
     return vOps;
 }
 
+// fuse_session_loop, notifying the kernel of stale attributes once each request is answered
+// notifications sent from within a request may deadlock on the locks the kernel holds for it
+int SessionLoop(fuse_session *pSession, Xxfs *px) {
+    fuse_buf vBuf {};
+    int nRes = 0;
+    while (!fuse_session_exited(pSession)) {
+        nRes = fuse_session_receive_buf(pSession, &vBuf);
+        if (nRes == -EINTR)
+            continue;
+        if (nRes <= 0)
+            break;
+        fuse_session_process_buf(pSession, &vBuf);
+        for (auto lin : px->TakeStale())
+            fuse_lowlevel_notify_inval_inode(pSession, ToIno(lin), -1, 0);
+    }
+    free(vBuf.mem);
+    fuse_session_reset(pSession);
+    return nRes < 0 ? nRes : 0;
+}
+
 void ShowHelp(const char *pszExec) {
     printf(
         "\n"
-        "Usage: %s [-v] filepath mountpoint\n"
+        "Usage: %s [-c] [-d] [-f] [-H] [-v] filepath mountpoint\n"
         "\n"
         "Options:\n"
+        "    -c       compress newly written data\n"
+        "    -d       store identical clusters of newly written data once\n"
         "    -f       run in foreground\n"
+        "    -H       map the bitmaps and the inode table with huge pages where possible\n"
         "    -v       enable verbose mode\n"
         "    -h       print this help\n",
         pszExec
     );
 }
 
-}}
+// run the build for another cluster size or lcn width, it parses the arguments again
+int RunFor(uint32_t uShift, uint32_t uLcnBits, int ncArg, char *ppszArgs[]) {
+    optind = 1;
+#define X_RUN(s_, b_) \
+    if (uShift == s_ && uLcnBits == b_) \
+        return XXFS_BUILD_NS(s_, b_)::XxfsMain(ncArg, ppszArgs);
+    XXFS_BUILDS(X_RUN)
+#undef X_RUN
+    fprintf(stderr, "The cluster size or the lcn width is not supported.\n");
+    return -1;
+}
 
-int main(int ncArg, char *ppszArgs[]) {
-    using namespace xxfs;
+}}}
+
+int xxfs::XXFS_CLU_NS::XxfsMain(int ncArg, char *ppszArgs[]) {
     const char *pszPath = nullptr;
     const char *pszMountPoint = nullptr;
+    bool bCompress = false;
+    bool bDedup = false;
     bool bForeground = false;
+    bool bHuge = false;
     bool bHelp = false;
     bool bIncorrect = false;
     int chOpt;
-    while ((chOpt = getopt(ncArg, ppszArgs, ":fhv")) != -1) {
+    while ((chOpt = getopt(ncArg, ppszArgs, ":cdfHhv")) != -1) {
         switch (chOpt) {
+        case 'c':
+            bCompress = true;
+            break;
+        case 'd':
+            bDedup = true;
+            break;
         case 'f':
             bForeground = true;
             break;
+        case 'H':
+            bHuge = true;
+            break;
         case 'v':
             f_bVerbose = true;
             break;
@@ -535,6 +781,9 @@ int main(int ncArg, char *ppszArgs[]) {
         ShowHelp(ppszArgs[0]);
         return -1;
     }
+    auto [uShift, uLcnBits] = ProbeBuild(pszPath);
+    if (uShift && (uShift != kCluShift || uLcnBits != kLcnBits))
+        return RunFor(uShift, uLcnBits, ncArg, ppszArgs);
     auto fd = open(pszPath, O_RDWR | O_DIRECT);
     if (fd == -1) {
         fprintf(stderr, "Failed to open file: %s.\n", pszPath);
@@ -563,22 +812,60 @@ int main(int ncArg, char *ppszArgs[]) {
         fprintf(stderr, "The filesystem is corrupt.\n");
         return -1;
     }
+    auto uVersion = spcMeta->uVersion;
+    if (uVersion > kVersion) {
+        fprintf(stderr, "The filesystem version %" PRIu32 " is not supported.\n", uVersion);
+        return -1;
+    }
     std::aligned_storage_t<sizeof(Xxfs)> vXxfs;
     try {
-        ::new(&vXxfs) Xxfs(std::move(vRf), std::move(spcMeta));
+        ::new(&vXxfs) Xxfs(std::move(vRf), std::move(spcMeta), bCompress, bDedup, bHuge);
     }
     catch (FatalException &e) {
         e.ShowWhat(stderr);
         return -1;
     }
+    if (uVersion < kVersion) {
+        printf("Converting the filesystem from version %" PRIu32 " to %" PRIu32 ".\n", uVersion, kVersion);
+        try {
+            ((Xxfs *) &vXxfs)->Upgrade();
+        }
+        catch (Exception &e) {
+            fprintf(stderr, "Failed to convert the filesystem: [%d] %s\n", e.nErrno, strerror(e.nErrno));
+            return -1;
+        }
+        catch (FatalException &e) {
+            e.ShowWhat(stderr);
+            return -1;
+        }
+    }
     constexpr auto vOps = XxfsOps();
     fuse_args vArgs {};
     fuse_opt_add_arg(&vArgs, ppszArgs[0]);
-    fuse_opt_add_arg(&vArgs, "-s");
-    if (bForeground)
-        fuse_opt_add_arg(&vArgs, "-f");
     if (f_bVerbose)
         fuse_opt_add_arg(&vArgs, "-d");
-    fuse_opt_add_arg(&vArgs, pszMountPoint);
-    return fuse_main(vArgs.argc, vArgs.argv, &vOps, &vXxfs);
+    auto pSession = fuse_session_new(&vArgs, &vOps, sizeof(vOps), &vXxfs);
+    if (!pSession) {
+        fuse_opt_free_args(&vArgs);
+        return -1;
+    }
+    int nRet = -1;
+    if (!fuse_set_signal_handlers(pSession)) {
+        if (!fuse_session_mount(pSession, pszMountPoint)) {
+            fuse_daemonize(bForeground);
+            // single threaded, Xxfs is not thread safe
+            nRet = SessionLoop(pSession, (Xxfs *) &vXxfs);
+            fuse_session_unmount(pSession);
+        }
+        fuse_remove_signal_handlers(pSession);
+    }
+    fuse_session_destroy(pSession);
+    fuse_opt_free_args(&vArgs);
+    return nRet;
+}
+
+#if XXFS_IS_DEFAULT
+int main(int ncArg, char *ppszArgs[]) {
+    return xxfs::XxfsMain(ncArg, ppszArgs);
 }
+#endif